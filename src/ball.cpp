@@ -0,0 +1,136 @@
+#include "ball.h"
+#include <algorithm>
+
+BallFeatures ball_features(const Blob& blob) {
+	double area = blob.m00;
+	double cx = blob.m10 / area;
+	double cy = blob.m01 / area;
+	// central second moments
+	double mu20 = blob.m20 - cx * blob.m10;
+	double mu02 = blob.m02 - cy * blob.m01;
+	double mu11 = blob.m11 - cx * blob.m01;
+
+	BallFeatures out;
+	out.circularity = area * area / (2 * M_PI * (mu20 + mu02));
+	// eigenvalues of the covariance matrix are the squared axes of the equivalent ellipse, up to a constant
+	double half_sum = (mu20 + mu02) / 2;
+	double root = sqrt((mu20 - mu02) * (mu20 - mu02) / 4 + mu11 * mu11);
+	double major = half_sum + root;
+	double minor = half_sum - root;
+	out.eccentricity = major > 0 ? sqrt(std::max(0.0, 1 - minor / major)) : 1.0;
+	out.fill = area / blob.rect().area();
+	return out;
+}
+
+BallMatch match_ball(const std::vector<Blob>& blobs) {
+	BallMatch out;
+	i64 best_area = 0;
+	for (usize i = 0; i < blobs.size(); i ++) {
+		// the cheapest test first, most blobs are small noise
+		if (blobs[i].m00 < BALL_MIN_AREA || blobs[i].m00 <= best_area) continue;
+
+		auto features = ball_features(blobs[i]);
+		if (features.circularity < BALL_MIN_CIRCULARITY || features.eccentricity > BALL_MAX_ECCENTRICITY) continue;
+		if (features.fill < BALL_MIN_FILL || features.fill > BALL_MAX_FILL) continue;
+
+		out.found = true;
+		out.index = i;
+		out.match = 1 - features.circularity;
+		best_area = blobs[i].m00;
+	}
+	return out;
+}
+
+// kasa fit, minimizes the algebraic distance sum((x^2 + y^2 + d x + e y + f)^2) which is a linear least squares problem
+// points are centered first so the sums stay well conditioned
+static bool fit_points(const std::vector<cv::Point2d>& points, Circle& out) {
+	if (points.size() < 5) return false;
+
+	double mean_x = 0;
+	double mean_y = 0;
+	for (const auto& p : points) {
+		mean_x += p.x;
+		mean_y += p.y;
+	}
+	mean_x /= points.size();
+	mean_y /= points.size();
+
+	double sxx = 0, syy = 0, sxy = 0, sxz = 0, syz = 0, sz = 0;
+	for (const auto& p : points) {
+		double x = p.x - mean_x;
+		double y = p.y - mean_y;
+		double z = x * x + y * y;
+		sxx += x * x;
+		syy += y * y;
+		sxy += x * y;
+		sxz += x * z;
+		syz += y * z;
+		sz += z;
+	}
+
+	// with centered points the sums of x and y are 0, so d and e come from a 2x2 system and f from the mean of z
+	double det = sxx * syy - sxy * sxy;
+	if (fabs(det) < 1e-9) return false;
+	double d = -(sxz * syy - syz * sxy) / det;
+	double e = -(syz * sxx - sxz * sxy) / det;
+	double f = -sz / points.size();
+
+	double r2 = (d * d + e * e) / 4 - f;
+	if (r2 <= 0) return false;
+	out.center = cv::Point2d(mean_x - d / 2, mean_y - e / 2);
+	out.radius = sqrt(r2);
+	return true;
+}
+
+static const int FIT_ITERATIONS = 8;
+
+bool fit_circle(const std::vector<BlobScratch::Run>& runs, cv::Rect rect, std::vector<cv::Point2d>& points, Circle& out) {
+	points.clear();
+
+	// outermost pixels of every row and column, runs are in raster order so each row's runs are together
+	std::vector<int> top(rect.width, -1);
+	std::vector<int> bottom(rect.width, -1);
+	for (usize i = 0; i < runs.size(); ) {
+		int y = runs[i].y;
+		int left = runs[i].x0;
+		int right = runs[i].x1;
+		for (; i < runs.size() && runs[i].y == y; i ++) {
+			left = std::min(left, runs[i].x0);
+			right = std::max(right, runs[i].x1);
+			for (int x = runs[i].x0; x <= runs[i].x1; x ++) {
+				if (top[x - rect.x] < 0) top[x - rect.x] = y;
+				bottom[x - rect.x] = y;
+			}
+		}
+		points.push_back(cv::Point2d(left, y));
+		if (right != left) points.push_back(cv::Point2d(right, y));
+	}
+	for (int i = 0; i < rect.width; i ++) {
+		if (top[i] < 0) continue;
+		points.push_back(cv::Point2d(rect.x + i, top[i]));
+		if (bottom[i] != top[i]) points.push_back(cv::Point2d(rect.x + i, bottom[i]));
+	}
+
+	if (!fit_points(points, out)) return false;
+
+	// the straight edge left by something in front of the ball pulls the fit inwards,
+	// each refit moves further out, so more of the edge falls inside until only the arc is left
+	for (int i = 0; i < FIT_ITERATIONS; i ++) {
+		double tolerance = std::max(1.0, 0.03 * out.radius);
+		usize before = points.size();
+		points.erase(std::remove_if(points.begin(), points.end(), [&] (const cv::Point2d& p) {
+			double dx = p.x - out.center.x;
+			double dy = p.y - out.center.y;
+			return sqrt(dx * dx + dy * dy) < out.radius - tolerance;
+		}), points.end());
+		if (points.size() == before) break;
+
+		Circle refit;
+		if (!fit_points(points, refit)) break;
+		out = refit;
+	}
+
+	// edge points are pixel centers, the edge of the ball is half a pixel further out
+	out.radius += 0.5;
+	return true;
+}
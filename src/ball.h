@@ -0,0 +1,48 @@
+#pragma once
+
+#include "types.h"
+#include "blobs.h"
+#include <opencv2/opencv.hpp>
+#include <math.h>
+#include <vector>
+
+// shape of a blob from its moments, each is 0 or 1 for a filled disk
+struct BallFeatures {
+	// area squared over 2 pi times the polar moment of inertia, 1 for a disk and lower for any other shape
+	double circularity;
+	// of the ellipse with the same second moments, 0 for a disk and approaching 1 for a line
+	double eccentricity;
+	// area divided by bounding box area, pi / 4 for a disk
+	double fill;
+};
+
+BallFeatures ball_features(const Blob& blob);
+
+// loose enough that a ball hidden up to about half still passes
+static const double BALL_MIN_CIRCULARITY = 0.75;
+static const double BALL_MAX_ECCENTRICITY = 0.9;
+static const double BALL_MIN_FILL = 0.6;
+static const double BALL_MAX_FILL = 0.9;
+// smaller blobs are too coarse for their shape to mean anything
+static const i64 BALL_MIN_AREA = 16;
+
+struct BallMatch {
+	bool found { false };
+	usize index { 0 };
+	// 1 - circularity, lower is better
+	double match { INFINITY };
+};
+
+// the largest blob that is round enough, only needs the moments of each blob
+BallMatch match_ball(const std::vector<Blob>& blobs);
+
+struct Circle {
+	cv::Point2d center;
+	double radius;
+};
+
+// least squares circle through the edge pixels of a blob, given by its runs from blob_runs and its bounding box
+// only the blob's own pixels are used, so other blobs overlapping its bounding box don't add edge points
+// edge points well inside the first fit are where something hides part of the ball, they are dropped and the circle fit again
+// returns false if there are too few edge points
+bool fit_circle(const std::vector<BlobScratch::Run>& runs, cv::Rect rect, std::vector<cv::Point2d>& points, Circle& out);
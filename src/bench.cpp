@@ -0,0 +1,348 @@
+#include "types.h"
+#include "argparse.hpp"
+#include "vision.h"
+#include "util.h"
+#include <opencv2/opencv.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+// runs a labelled corpus of frames through Vision::process under a sweep of settings,
+// so the detection quality a faster setting costs can be seen next to the time it saves
+
+// one line of the corpus file:
+// image,present[,x,y,width,height,distance[,angle]]
+// the bounding box and distance are only given for frames containing the target, and are at the calibrated resolution
+// if the angle is left out it is computed from the bounding box with the same camera model Vision uses
+struct Label {
+	std::string file;
+	cv::Mat image;
+	bool present;
+	cv::Rect rect;
+	double distance;
+	double angle;
+};
+
+struct Settings {
+	double scale;
+	int threads;
+	int morph_size;
+	double max_match;
+};
+
+struct Stats {
+	Settings settings;
+	int frames { 0 };
+	int present { 0 };
+	// frames with the target found where it was labelled
+	int detected { 0 };
+	// frames where something was reported that isn't the labelled target
+	int false_positives { 0 };
+	// frames correctly reported as not containing the target
+	int true_negatives { 0 };
+	double distance_error { 0.0 };
+	double angle_error { 0.0 };
+	std::vector<long> times;
+	bool pareto { false };
+
+	double accuracy() const { return (double) (detected + true_negatives) / frames; }
+	double mean_usec() const {
+		long total = 0;
+		for (long time : times) total += time;
+		return (double) total / times.size();
+	}
+};
+
+static std::vector<std::string> split(const std::string& str, char delim) {
+	std::vector<std::string> out;
+	std::istringstream stream(str);
+	std::string item;
+	while (std::getline(stream, item, delim)) out.push_back(item);
+	return out;
+}
+
+template<typename T>
+static std::optional<std::vector<T>> parse_list(const std::string& str) {
+	std::vector<T> out;
+	for (const auto& item : split(str, ',')) {
+		char *end = nullptr;
+		double value = strtod(item.c_str(), &end);
+		if (item.empty() || *end != '\0' || !(value > 0)) return {};
+		out.push_back(value);
+	}
+	if (out.empty()) return {};
+	return out;
+}
+
+static std::optional<std::vector<Label>> read_corpus(const std::string& file_name) {
+	std::ifstream file(file_name);
+	if (!file) {
+		printf("error: could not open corpus '%s'\n", file_name.c_str());
+		return {};
+	}
+
+	// image paths are relative to the corpus file
+	auto slash = file_name.rfind('/');
+	auto dir = slash == std::string::npos ? std::string {} : file_name.substr(0, slash + 1);
+
+	std::vector<Label> out;
+	std::string line;
+	int line_number = 0;
+	while (std::getline(file, line)) {
+		line_number ++;
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (line.empty() || line[0] == '#') continue;
+
+		auto fields = split(line, ',');
+		Label label {};
+		bool ok = fields.size() >= 2;
+		if (ok) {
+			label.file = fields[0];
+			label.present = atoi(fields[1].c_str()) != 0;
+			ok = label.present ? fields.size() == 7 || fields.size() == 8 : fields.size() == 2;
+		}
+		if (ok && label.present) {
+			label.rect = cv::Rect(atoi(fields[2].c_str()), atoi(fields[3].c_str()), atoi(fields[4].c_str()), atoi(fields[5].c_str()));
+			label.distance = atof(fields[6].c_str());
+			label.angle = fields.size() == 8 ? atof(fields[7].c_str()) : target_angle(label.rect.x + label.rect.width / 2);
+			ok = !label.rect.empty() && label.distance > 0;
+		}
+		if (!ok) {
+			printf("error: %s:%d: expected image,0 or image,1,x,y,width,height,distance[,angle]\n", file_name.c_str(), line_number);
+			return {};
+		}
+
+		label.image = cv::imread(dir + label.file, cv::IMREAD_COLOR);
+		if (label.image.empty()) {
+			printf("error: %s:%d: image '%s' empty or missing\n", file_name.c_str(), line_number, label.file.c_str());
+			return {};
+		}
+		out.push_back(std::move(label));
+	}
+
+	if (out.empty()) {
+		printf("error: corpus '%s' has no frames\n", file_name.c_str());
+		return {};
+	}
+	return out;
+}
+
+static double overlap(cv::Rect a, cv::Rect b) {
+	double intersection = (a & b).area();
+	return intersection / (a.area() + b.area() - intersection);
+}
+
+// a setting is on the pareto front if no other setting is at least as accurate and as fast, and better at one of them
+static void mark_pareto(std::vector<Stats>& results) {
+	for (auto& a : results) {
+		a.pareto = true;
+		for (const auto& b : results) {
+			bool no_worse = b.accuracy() >= a.accuracy() && b.mean_usec() <= a.mean_usec();
+			bool better = b.accuracy() > a.accuracy() || b.mean_usec() < a.mean_usec();
+			if (no_worse && better) {
+				a.pareto = false;
+				break;
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	argparse::ArgumentParser program("vision_bench", "0.1.0");
+
+	program.add_argument("--scales")
+		.help("comma separated frame scales to try, frames are downscaled before they are timed")
+		.default_value(std::string {"1,0.75,0.5"});
+
+	program.add_argument("--threads")
+		.help("comma separated thread counts to try")
+		.default_value(std::string {"1,2,4"});
+
+	program.add_argument("--morph")
+		.help("comma separated morphology kernel sizes to try, 1 skips morphology")
+		.default_value(std::string {"1,3,5"});
+
+	program.add_argument("--max-match")
+		.help("comma separated template match cutoffs to try")
+		.default_value(std::string {"0.5,1,1.5"});
+
+	program.add_argument("--repeat")
+		.help("amount of times each frame is processed with each setting")
+		.default_value(3)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--overlap")
+		.help("intersection over union with the labelled box needed for a detection to count")
+		.default_value(0.5)
+		.action([] (const std::string& str) {
+			return std::atof(str.c_str());
+		});
+
+	program.add_argument("template")
+		.help("template image file to process");
+
+	program.add_argument("corpus")
+		.help("csv file listing labelled frames");
+
+	try {
+		program.parse_args (argc, argv);
+	} catch (const std::runtime_error& err) {
+		std::cout << err.what() << std::endl;
+		std::cout << program;
+		exit(1);
+	}
+
+	auto scales = parse_list<double>(program.get("--scales"));
+	auto thread_counts = parse_list<int>(program.get("--threads"));
+	auto morph_sizes = parse_list<int>(program.get("--morph"));
+	auto max_matches = parse_list<double>(program.get("--max-match"));
+	const int repeat = program.get<int>("--repeat");
+	const double min_overlap = program.get<double>("--overlap");
+	if (!scales.has_value() || !thread_counts.has_value() || !morph_sizes.has_value() || !max_matches.has_value()) {
+		printf("error: sweep lists must be comma separated positive numbers\n");
+		exit(1);
+	}
+	for (double scale : *scales) {
+		if (scale > 1) {
+			printf("error: scales can't be larger than 1\n");
+			exit(1);
+		}
+	}
+	for (int morph_size : *morph_sizes) {
+		if (morph_size % 2 == 0) {
+			printf("error: morphology kernel sizes must be odd\n");
+			exit(1);
+		}
+	}
+	if (repeat < 1) {
+		printf("error: repeat must be at least 1\n");
+		exit(1);
+	}
+
+	auto template_file = program.get("template");
+	auto template_img = cv::imread(template_file, cv::IMREAD_COLOR);
+	if (template_img.empty()) {
+		printf("template file '%s' empty or missing\n", template_file.c_str());
+		exit(1);
+	}
+
+	auto corpus = read_corpus(program.get("corpus"));
+	if (!corpus.has_value()) exit(1);
+
+	std::optional<Vision> vis_storage;
+	try {
+		vis_storage.emplace(template_img, 1);
+	} catch (const std::runtime_error& err) {
+		printf("error: template file '%s': %s\n", template_file.c_str(), err.what());
+		exit(1);
+	}
+	Vision& vis = *vis_storage;
+
+	std::vector<Stats> results;
+	std::vector<cv::Mat> frames;
+	VisionContext ctx;
+
+	for (double scale : *scales) {
+		// resizing isn't timed, a lower resolution would come from the camera
+		frames.clear();
+		for (const auto& label : *corpus) {
+			cv::Mat frame;
+			if (scale == 1) {
+				frame = label.image;
+			} else {
+				cv::resize(label.image, frame, cv::Size(), scale, scale, cv::INTER_AREA);
+			}
+			frames.push_back(frame);
+		}
+		ctx.scale = scale;
+
+		for (int morph_size : *morph_sizes) {
+			for (double max_match : *max_matches) {
+				VisionParams settings;
+				settings.morph_size = morph_size;
+				settings.max_match = max_match;
+				try {
+					vis.set_params(make_vision_params(settings, template_img));
+				} catch (const std::runtime_error& err) {
+					printf("error: template with morphology kernel size %d: %s\n", morph_size, err.what());
+					exit(1);
+				}
+
+				for (int threads : *thread_counts) {
+					vis.set_threads(threads);
+					cv::setNumThreads(threads);
+
+					Stats stats;
+					stats.settings = { scale, threads, morph_size, max_match };
+					stats.times.reserve(frames.size() * repeat);
+
+					// one untimed pass so allocations and thread startup aren't counted against the first setting
+					for (const auto& frame : frames) {
+						vis.process(frame, ctx);
+					}
+
+					for (usize i = 0; i < frames.size(); i ++) {
+						const auto& label = (*corpus)[i];
+						std::optional<Target> target;
+						for (int j = 0; j < repeat; j ++) {
+							long start_usec = get_usec();
+							target = vis.process(frames[i], ctx);
+							stats.times.push_back(get_usec() - start_usec);
+						}
+
+						stats.frames ++;
+						if (label.present) stats.present ++;
+						if (!target.has_value()) {
+							if (!label.present) stats.true_negatives ++;
+							continue;
+						}
+
+						// the box is found in the scaled frame, but labelled at the calibrated resolution
+						auto rect = target->rect;
+						cv::Rect found(cvRound(rect.x / scale), cvRound(rect.y / scale), cvRound(rect.width / scale), cvRound(rect.height / scale));
+						if (label.present && overlap(found, label.rect) >= min_overlap) {
+							stats.detected ++;
+							stats.distance_error += fabs(target->distance - label.distance) / label.distance;
+							stats.angle_error += fabs(target->angle - label.angle);
+						} else {
+							stats.false_positives ++;
+						}
+					}
+
+					std::sort(stats.times.begin(), stats.times.end());
+					results.push_back(std::move(stats));
+				}
+			}
+		}
+	}
+
+	mark_pareto(results);
+	std::sort(results.begin(), results.end(), [] (const Stats& a, const Stats& b) {
+		return a.mean_usec() < b.mean_usec();
+	});
+
+	int present = results.front().present;
+	printf("frames: %d  with target: %d  repeat: %d  overlap: %.2f\n", results.front().frames, present, repeat, min_overlap);
+	printf("detect is the share of frames with the target where it was found, fp the share of all frames with a wrong result\n");
+	printf("distance error is relative, angle error in degrees, both averaged over detections\n\n");
+	printf("pareto  scale  threads  morph  match  accuracy  detect    fp  dist err  angle err  mean usec  p99 usec\n");
+	for (const auto& stats : results) {
+		const auto& settings = stats.settings;
+		double detect = present > 0 ? 100.0 * stats.detected / present : 0.0;
+		double distance_error = stats.detected > 0 ? 100.0 * stats.distance_error / stats.detected : 0.0;
+		double angle_error = stats.detected > 0 ? stats.angle_error / stats.detected : 0.0;
+		printf("%6s  %5.2f  %7d  %5d  %5.2f  %7.1f%%  %5.1f%%  %3.1f%%  %7.1f%%  %9.2f  %9.1f  %8ld\n",
+			stats.pareto ? "*" : "",
+			settings.scale, settings.threads, settings.morph_size, settings.max_match,
+			100.0 * stats.accuracy(), detect, 100.0 * stats.false_positives / stats.frames,
+			distance_error, angle_error,
+			stats.mean_usec(), stats.times[stats.times.size() * 99 / 100]);
+	}
+}
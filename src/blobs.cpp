@@ -0,0 +1,212 @@
+#include "blobs.h"
+#include "parallel.h"
+#include <algorithm>
+
+cv::Rect Blob::rect() const {
+	return cv::Rect(x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
+}
+
+cv::Moments Blob::moments() const {
+	return cv::Moments(m00, m10, m01, m20, m11, m02, m30, m21, m12, m03);
+}
+
+// sums of x, x^2 and x^3 for x from 0 to n, so the sums over a run are the difference of two of them
+static i64 sum1(i64 n) { return n * (n + 1) / 2; }
+static i64 sum2(i64 n) { return n * (n + 1) * (2 * n + 1) / 6; }
+static i64 sum3(i64 n) { return sum1(n) * sum1(n); }
+
+static Blob run_blob(const BlobScratch::Run& run) {
+	i64 y = run.y;
+	i64 n = run.x1 - run.x0 + 1;
+	i64 s1 = sum1(run.x1) - sum1(run.x0 - 1);
+	i64 s2 = sum2(run.x1) - sum2(run.x0 - 1);
+	i64 s3 = sum3(run.x1) - sum3(run.x0 - 1);
+
+	Blob out;
+	out.x_min = run.x0;
+	out.x_max = run.x1;
+	out.y_min = run.y;
+	out.y_max = run.y;
+	out.m00 = n;
+	out.m10 = s1;
+	out.m01 = n * y;
+	out.m20 = s2;
+	out.m11 = s1 * y;
+	out.m02 = n * y * y;
+	out.m30 = s3;
+	out.m21 = s2 * y;
+	out.m12 = s1 * y * y;
+	out.m03 = n * y * y * y;
+	return out;
+}
+
+static void add_blob(Blob& out, const Blob& in) {
+	out.x_min = std::min(out.x_min, in.x_min);
+	out.y_min = std::min(out.y_min, in.y_min);
+	out.x_max = std::max(out.x_max, in.x_max);
+	out.y_max = std::max(out.y_max, in.y_max);
+	out.m00 += in.m00;
+	out.m10 += in.m10;
+	out.m01 += in.m01;
+	out.m20 += in.m20;
+	out.m11 += in.m11;
+	out.m02 += in.m02;
+	out.m30 += in.m30;
+	out.m21 += in.m21;
+	out.m12 += in.m12;
+	out.m03 += in.m03;
+}
+
+static i32 find_root(std::vector<i32>& parent, i32 i) {
+	while (parent[i] != i) {
+		// path halving
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+// the smaller index always becomes the root, so every set is rooted at its first element
+static void unite(std::vector<i32>& parent, i32 a, i32 b) {
+	a = find_root(parent, a);
+	b = find_root(parent, b);
+	if (a < b) {
+		parent[b] = a;
+	} else if (b < a) {
+		parent[a] = b;
+	}
+}
+
+// calls func for every pair of runs from two neighbouring rows that touch, each row sorted by x
+// with 8-connectivity runs touch if they overlap once widened by a pixel
+template<typename F>
+static void touching_runs(const BlobScratch::Run *above, usize above_len, const BlobScratch::Run *below, usize below_len, F func) {
+	usize start = 0;
+	for (usize i = 0; i < below_len; i ++) {
+		while (start < above_len && above[start].x1 < below[i].x0 - 1) start ++;
+		for (usize j = start; j < above_len && above[j].x0 <= below[i].x1 + 1; j ++) {
+			func(j, i);
+		}
+	}
+}
+
+static void label_strip(cv::Mat mask, BlobScratch::Strip& strip) {
+	auto& runs = strip.runs;
+	auto& parent = strip.parent;
+	runs.clear();
+	parent.clear();
+	strip.comps.clear();
+
+	usize above_begin = 0;
+	usize above_end = 0;
+	for (int y = strip.y0; y < strip.y1; y ++) {
+		const u8 *row = mask.ptr<u8>(y);
+		usize row_begin = runs.size();
+		for (int x = 0; x < mask.cols; ) {
+			while (x < mask.cols && row[x] == 0) x ++;
+			if (x == mask.cols) break;
+			int x0 = x;
+			while (x < mask.cols && row[x] != 0) x ++;
+
+			parent.push_back(runs.size());
+			runs.push_back({ x0, x - 1, y, -1 });
+		}
+
+		touching_runs(runs.data() + above_begin, above_end - above_begin, runs.data() + row_begin, runs.size() - row_begin, [&] (usize above, usize below) {
+			unite(parent, above_begin + above, row_begin + below);
+		});
+		above_begin = row_begin;
+		above_end = runs.size();
+	}
+
+	// every component is rooted at its first run, so numbering roots in run order numbers components by their first pixel
+	for (usize i = 0; i < runs.size(); i ++) {
+		i32 root = find_root(parent, i);
+		if (root == (i32) i) {
+			runs[i].comp = strip.comps.size();
+			strip.comps.push_back(run_blob(runs[i]));
+		} else {
+			runs[i].comp = runs[root].comp;
+			add_blob(strip.comps[runs[i].comp], run_blob(runs[i]));
+		}
+	}
+}
+
+void extract_blobs(cv::Mat mask, std::vector<Blob>& out, BlobScratch& scratch, int threads, int strip_rows) {
+	out.clear();
+	if (mask.empty()) return;
+
+	if (strip_rows <= 0) {
+		strip_rows = (mask.rows + threads - 1) / std::max(threads, 1);
+	}
+	int strip_count = threads > 1 ? (mask.rows + strip_rows - 1) / strip_rows : 1;
+
+	auto& strips = scratch.strips;
+	strips.resize(strip_count);
+	for (int i = 0; i < strip_count; i ++) {
+		strips[i].y0 = mask.rows * (i64) i / strip_count;
+		strips[i].y1 = mask.rows * (i64) (i + 1) / strip_count;
+	}
+
+	parallel_for(strip_count, 1, threads, [&] (int begin, int end) {
+		for (int i = begin; i < end; i ++) {
+			label_strip(mask, strips[i]);
+		}
+	});
+
+	// components are numbered globally by strip and then by first pixel, so global numbers are in raster order too
+	std::vector<i32>& comp_parent = scratch.comp_parent;
+	comp_parent.clear();
+	std::vector<i32>& offsets = scratch.strip_offsets;
+	offsets.resize(strip_count);
+	for (int i = 0; i < strip_count; i ++) {
+		offsets[i] = comp_parent.size();
+		for (usize j = 0; j < strips[i].comps.size(); j ++) {
+			comp_parent.push_back(comp_parent.size());
+		}
+	}
+
+	// only the last row of a strip can touch the first row of the next one
+	for (int i = 1; i < strip_count; i ++) {
+		const auto& above = strips[i - 1].runs;
+		const auto& below = strips[i].runs;
+		int boundary = strips[i].y0;
+
+		usize above_begin = above.size();
+		while (above_begin > 0 && above[above_begin - 1].y == boundary - 1) above_begin --;
+		usize below_end = 0;
+		while (below_end < below.size() && below[below_end].y == boundary) below_end ++;
+
+		touching_runs(above.data() + above_begin, above.size() - above_begin, below.data(), below_end, [&] (usize a, usize b) {
+			unite(comp_parent, offsets[i - 1] + above[above_begin + a].comp, offsets[i] + below[b].comp);
+		});
+	}
+
+	// every merged blob is rooted at the component with its first pixel, so blobs come out in the same order as with one strip
+	auto& comp_blob = scratch.comp_blob;
+	comp_blob.resize(comp_parent.size());
+	for (int i = 0; i < strip_count; i ++) {
+		for (usize j = 0; j < strips[i].comps.size(); j ++) {
+			i32 comp = offsets[i] + j;
+			i32 root = find_root(comp_parent, comp);
+			if (root == comp) {
+				comp_blob[comp] = out.size();
+				out.push_back(strips[i].comps[j]);
+			} else {
+				add_blob(out[comp_blob[root]], strips[i].comps[j]);
+			}
+		}
+	}
+}
+
+void blob_runs(const BlobScratch& scratch, usize index, std::vector<BlobScratch::Run>& out) {
+	out.clear();
+	for (usize i = 0; i < scratch.strip_offsets.size(); i ++) {
+		for (const auto& run : scratch.strips[i].runs) {
+			// the scratch is const, so roots are found without compressing paths
+			i32 comp = scratch.strip_offsets[i] + run.comp;
+			while (scratch.comp_parent[comp] != comp) comp = scratch.comp_parent[comp];
+			if ((usize) scratch.comp_blob[comp] == index) out.push_back(run);
+		}
+	}
+}
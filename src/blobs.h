@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// an 8-connected component of non zero pixels in a mask
+struct Blob {
+	int x_min;
+	int y_min;
+	int x_max;
+	int y_max;
+	// raw spatial moments of the pixels, kept as integers so the result doesn't depend on the order strips are reduced in
+	i64 m00, m10, m01, m20, m11, m02, m30, m21, m12, m03;
+
+	cv::Rect rect() const;
+	// same as cv::moments of the blob's pixels as a binary image
+	cv::Moments moments() const;
+};
+
+// reused between frames to avoid reallocations, see extract_blobs
+struct BlobScratch {
+	// horizontal run of pixels, comp is the component it belongs to within its strip
+	struct Run {
+		i32 x0;
+		i32 x1;
+		i32 y;
+		i32 comp;
+	};
+
+	struct Strip {
+		int y0;
+		int y1;
+		std::vector<Run> runs;
+		std::vector<i32> parent;
+		std::vector<Blob> comps;
+	};
+
+	std::vector<Strip> strips;
+	// global number of the first component of each strip
+	std::vector<i32> strip_offsets;
+	std::vector<i32> comp_parent;
+	std::vector<i32> comp_blob;
+};
+
+// labels the mask strip by strip in parallel, merges components crossing strip boundaries with union find
+// and reduces their statistics into blobs
+// blobs are in the order of their first pixel in raster order, and are identical whatever the amount of strips
+void extract_blobs(cv::Mat mask, std::vector<Blob>& out, BlobScratch& scratch, int threads, int strip_rows);
+// the runs of pixels of blob index from the last extract_blobs call with scratch, in raster order
+void blob_runs(const BlobScratch& scratch, usize index, std::vector<BlobScratch::Run>& out);
@@ -0,0 +1,216 @@
+#include "debug_stream.h"
+#include "render.h"
+#include "util.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+static const char *RESPONSE_HEADER =
+	"HTTP/1.0 200 OK\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Connection: close\r\n"
+	"Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+	"\r\n";
+
+static const char *NOT_FOUND =
+	"HTTP/1.0 404 Not Found\r\n"
+	"Content-Type: text/plain\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"available streams: / /frame /mask\n";
+
+// room for a few frames in each client's socket buffer, frames are only sent if they fit
+static const int CLIENT_SEND_BUFFER = 1 << 20;
+
+// flags can add MSG_DONTWAIT, then it fails instead of waiting when the socket buffer is full
+static bool send_all(int fd, const void *data, usize len, int flags = 0) {
+	auto bytes = static_cast<const u8 *>(data);
+	while (len > 0) {
+		ssize_t sent = send(fd, bytes, len, MSG_NOSIGNAL | flags);
+		if (sent <= 0) return false;
+		bytes += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+DebugStream::~DebugStream() {
+	m_stop = true;
+	if (m_accept_thread.joinable()) m_accept_thread.join();
+	if (m_encode_thread.joinable()) m_encode_thread.join();
+
+	for (auto& client : m_clients) {
+		close(client.fd);
+	}
+	if (m_listen_fd >= 0) close(m_listen_fd);
+	delete m_pending.exchange(nullptr);
+}
+
+bool DebugStream::open(int port, int max_fps) {
+	m_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (m_listen_fd < 0) return false;
+
+	int reuse = 1;
+	setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	// only reachable from the unit itself, use an ssh tunnel to watch remotely
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(m_listen_fd, (sockaddr *) &addr, sizeof(addr)) || listen(m_listen_fd, 4)) {
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return false;
+	}
+
+	m_frame_usec = 1000000 / std::max(max_fps, 1);
+	m_accept_thread = std::thread([this] () { accept_thread(); });
+	m_encode_thread = std::thread([this] () { encode_thread(); });
+	return true;
+}
+
+bool DebugStream::wanted() const {
+	return m_client_count.load(std::memory_order_relaxed) > 0;
+}
+
+void DebugStream::publish(std::shared_ptr<DebugSnapshot> snapshot) {
+	if (snapshot == nullptr || !wanted()) return;
+
+	auto boxed = new std::shared_ptr<DebugSnapshot>(std::move(snapshot));
+	// a snapshot the encoder didn't get to in time is dropped
+	delete m_pending.exchange(boxed, std::memory_order_acq_rel);
+}
+
+void DebugStream::accept_thread() {
+	// started from the capture thread, whose real time policy it would otherwise inherit
+	set_low_priority();
+	pollfd listen_poll { m_listen_fd, POLLIN, 0 };
+
+	while (!m_stop) {
+		// wake up regularly to check if the stream is being shut down
+		if (poll(&listen_poll, 1, 200) <= 0) continue;
+
+		int fd = accept(m_listen_fd, nullptr, nullptr);
+		if (fd < 0) continue;
+
+		// a client that doesn't send its request or read its frames must not stall the stream for long
+		timeval timeout { 1, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &CLIENT_SEND_BUFFER, sizeof(CLIENT_SEND_BUFFER));
+
+		char request[512];
+		ssize_t len = recv(fd, request, sizeof(request) - 1, 0);
+		if (len <= 0) {
+			close(fd);
+			continue;
+		}
+		request[len] = '\0';
+
+		// only the path of the request line matters, everything else is ignored
+		char path[64] = "";
+		sscanf(request, "GET %63s", path);
+
+		Client client { fd, View::Both };
+		if (strcmp(path, "/") == 0) {
+			client.view = View::Both;
+		} else if (strcmp(path, "/frame") == 0) {
+			client.view = View::Frame;
+		} else if (strcmp(path, "/mask") == 0) {
+			client.view = View::Mask;
+		} else {
+			send_all(fd, NOT_FOUND, strlen(NOT_FOUND));
+			close(fd);
+			continue;
+		}
+
+		if (!send_all(fd, RESPONSE_HEADER, strlen(RESPONSE_HEADER))) {
+			close(fd);
+			continue;
+		}
+
+		std::lock_guard<std::mutex> guard(m_clients_lock);
+		m_clients.push_back(client);
+		m_client_count = m_clients.size();
+		LOG_INFO("debug stream client connected, %d watching", m_client_count.load());
+	}
+}
+
+void DebugStream::encode_thread() {
+	set_low_priority();
+
+	std::vector<u8> jpeg;
+	char part_header[128];
+	// sent to outside the lock, so a slow client never holds up the accept thread
+	std::vector<Client> clients;
+	std::vector<int> dropped;
+
+	while (!m_stop) {
+		long start_usec = get_usec();
+
+		std::unique_ptr<std::shared_ptr<DebugSnapshot>> boxed(m_pending.exchange(nullptr, std::memory_order_acq_rel));
+		if (boxed != nullptr) {
+			const auto& snapshot = **boxed;
+			cv::Mat composed = compose_debug_frame(snapshot);
+			int frame_width = snapshot.frame.cols;
+
+			{
+				std::lock_guard<std::mutex> guard(m_clients_lock);
+				clients = m_clients;
+			}
+			dropped.clear();
+
+			// each view is encoded at most once per frame, and only if someone is watching it
+			for (auto view : { View::Both, View::Frame, View::Mask }) {
+				bool watched = false;
+				for (const auto& client : clients) {
+					watched |= client.view == view;
+				}
+				if (!watched) continue;
+
+				cv::Mat img;
+				switch (view) {
+					case View::Both: img = composed; break;
+					case View::Frame: img = composed(cv::Rect(0, 0, frame_width, composed.rows)); break;
+					case View::Mask: img = composed(cv::Rect(frame_width, 0, composed.cols - frame_width, composed.rows)); break;
+				}
+				cv::imencode(".jpg", img, jpeg, { cv::IMWRITE_JPEG_QUALITY, 80 });
+
+				int header_len = snprintf(part_header, sizeof(part_header), "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", jpeg.size());
+				for (const auto& client : clients) {
+					if (client.view != view) continue;
+
+					// a client whose buffer can't take the whole frame is too slow to keep up, and a partly sent frame
+					// would break its stream, so it is dropped rather than making every other client wait for it
+					bool ok = send_all(client.fd, part_header, header_len, MSG_DONTWAIT)
+						&& send_all(client.fd, jpeg.data(), jpeg.size(), MSG_DONTWAIT)
+						&& send_all(client.fd, "\r\n", 2, MSG_DONTWAIT);
+					if (!ok) dropped.push_back(client.fd);
+				}
+			}
+
+			if (!dropped.empty()) {
+				std::lock_guard<std::mutex> guard(m_clients_lock);
+				for (int fd : dropped) {
+					close(fd);
+					m_clients.erase(std::remove_if(m_clients.begin(), m_clients.end(), [fd] (const Client& client) {
+						return client.fd == fd;
+					}), m_clients.end());
+				}
+				m_client_count = m_clients.size();
+				LOG_INFO("debug stream client dropped, %d watching", m_client_count.load());
+			}
+		}
+
+		long remaining_usec = m_frame_usec - (get_usec() - start_usec);
+		std::this_thread::sleep_for(std::chrono::microseconds(std::max(remaining_usec, 1000L)));
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+#include "vision.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// serves the annotated frame and mask as an mjpeg stream over http on localhost, for headless units
+// jpegs are only encoded while a client is connected, on a low priority thread at a capped rate
+class DebugStream {
+	public:
+		DebugStream() = default;
+		~DebugStream();
+
+		bool open(int port, int max_fps);
+
+		// true if any client is connected, when false there is no need to capture snapshots
+		bool wanted() const;
+
+		// never blocks, replaces any snapshot the encoder thread hasn't picked up yet
+		void publish(std::shared_ptr<DebugSnapshot> snapshot);
+
+	private:
+		enum class View {
+			// annotated frame and mask side by side
+			Both,
+			Frame,
+			Mask,
+		};
+
+		struct Client {
+			int fd;
+			View view;
+		};
+
+		void accept_thread();
+		void encode_thread();
+
+		int m_listen_fd { -1 };
+		long m_frame_usec { 0 };
+
+		std::atomic<bool> m_stop { false };
+		std::atomic<int> m_client_count { 0 };
+		// boxed so publishing is a single pointer exchange
+		std::atomic<std::shared_ptr<DebugSnapshot> *> m_pending { nullptr };
+
+		// only shared between the accept and encode threads, only the accept thread adds and only the encode thread removes
+		std::mutex m_clients_lock;
+		std::vector<Client> m_clients;
+
+		std::thread m_accept_thread;
+		std::thread m_encode_thread;
+};
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <memory>
+
+// a captured frame
+struct Frame {
+	cv::Mat image;
+	// microseconds since the unix epoch
+	long capture_usec;
+	// size of the image relative to the camera resolution, and where it is in the camera frame at that size
+	// sources that decode reduced or cropped frames set these so targets are still measured in camera pixels
+	double scale { 1.0 };
+	cv::Point offset;
+	// set by sources that know where the target is, truth is then its bounding box, or empty if it isn't in the frame
+	bool has_truth { false };
+	cv::Rect truth;
+	// if the image points into memory owned by the source, it stays valid for as long as this is held
+	std::shared_ptr<void> lease;
+};
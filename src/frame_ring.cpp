@@ -0,0 +1,263 @@
+#include "frame_ring.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+
+static const usize PAGE_SIZE = 4096;
+static const u64 SLOT_BITS = 16;
+
+static usize page_align(usize size) {
+	return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+FrameRingWriter::~FrameRingWriter() {
+	if (m_mem != nullptr) {
+		munmap(m_mem, m_size);
+		shm_unlink(m_name.c_str());
+	}
+}
+
+bool FrameRingWriter::open(const std::string& name, u32 slot_count, int width, int height, int type) {
+	if (slot_count == 0 || slot_count > (1u << SLOT_BITS) || width <= 0 || height <= 0) {
+		return false;
+	}
+
+	usize stride = width * CV_ELEM_SIZE(type);
+	usize slot_size = page_align(stride * height);
+	usize data_offset = page_align(sizeof(FrameRingHeader) + slot_count * sizeof(FrameRingSlot));
+	usize size = data_offset + slot_count * slot_size;
+
+	// readers of an old ring keep their mapping of it, new readers get the new one
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) return false;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	m_name = name;
+	m_mem = static_cast<u8 *>(mem);
+	m_size = size;
+	m_header = reinterpret_cast<FrameRingHeader *>(m_mem);
+	m_slots = reinterpret_cast<FrameRingSlot *>(m_mem + sizeof(FrameRingHeader));
+
+	// the segment is zero filled by ftruncate, so every slot starts out empty and unreferenced
+	m_header->slot_count = slot_count;
+	m_header->width = width;
+	m_header->height = height;
+	m_header->type = type;
+	m_header->stride = stride;
+	m_header->slot_size = slot_size;
+	m_header->data_offset = data_offset;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (u32 i = 0; i < FRAME_RING_MAX_READERS; i ++) {
+		pthread_mutex_init(&m_header->reader_locks[i], &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+	m_header->version = FRAME_RING_VERSION;
+	// readers check the magic last, so it is written after everything else
+	std::atomic_thread_fence(std::memory_order_release);
+	m_header->magic = FRAME_RING_MAGIC;
+
+	return true;
+}
+
+bool FrameRingWriter::is_open() const {
+	return m_mem != nullptr;
+}
+
+static bool slot_in_use(const FrameRingSlot& slot) {
+	for (u32 i = 0; i < FRAME_RING_MAX_READERS; i ++) {
+		if (slot.refs[i].load() != 0) return true;
+	}
+	return false;
+}
+
+u32 FrameRingWriter::reclaim_dead_readers() {
+	static auto& reclaimed_metric = metrics_counter("vision_ring_readers_reclaimed_total", "shared memory ring readers whose process exited without releasing its frames");
+
+	u32 out = 0;
+	for (u32 i = 0; i < FRAME_RING_MAX_READERS; i ++) {
+		// busy means a live reader holds the entry, and a free entry has no references to drop
+		int err = pthread_mutex_trylock(&m_header->reader_locks[i]);
+		if (err != 0 && err != EOWNERDEAD) continue;
+
+		if (err == EOWNERDEAD) {
+			// the reader is gone, and the entry can't be claimed while it is locked here, so nothing else touches its references
+			for (u32 j = 0; j < m_header->slot_count; j ++) {
+				m_slots[j].refs[i].store(0);
+			}
+			pthread_mutex_consistent(&m_header->reader_locks[i]);
+			LOG_WARN("frame ring reader %u exited without releasing its frames, reclaimed them", i);
+			reclaimed_metric.add();
+			out ++;
+		}
+		pthread_mutex_unlock(&m_header->reader_locks[i]);
+	}
+	return out;
+}
+
+bool FrameRingWriter::write(const cv::Mat& frame, long capture_usec) {
+	if (frame.cols != (int) m_header->width || frame.rows != (int) m_header->height || frame.type() != (int) m_header->type) {
+		return false;
+	}
+
+	u32 slot_count = m_header->slot_count;
+	bool reclaimed = false;
+	for (u32 attempt = 0; attempt < slot_count; attempt ++) {
+		u32 index = m_next_slot;
+		m_next_slot = (m_next_slot + 1) % slot_count;
+
+		auto& slot = m_slots[index];
+		u64 old_seq = slot.seq.load(std::memory_order_relaxed);
+
+		// claim the slot before checking for readers, a reader which takes a reference after this sees seq 0 and backs off
+		// both sides use sequentially consistent operations, so at least one of them sees the other
+		slot.seq.store(0);
+		bool in_use = slot_in_use(slot);
+		if (in_use && !reclaimed) {
+			// a reader that crashed while holding a frame never releases it, which would eventually take every slot
+			reclaimed = true;
+			if (reclaim_dead_readers() > 0) in_use = slot_in_use(slot);
+		}
+		if (in_use) {
+			slot.seq.store(old_seq);
+			continue;
+		}
+
+		u8 *dst = m_mem + m_header->data_offset + index * m_header->slot_size;
+		usize row_size = m_header->stride;
+		for (int row = 0; row < frame.rows; row ++) {
+			memcpy(dst + row * row_size, frame.ptr(row), row_size);
+		}
+
+		m_seq ++;
+		slot.capture_usec.store(capture_usec, std::memory_order_relaxed);
+		slot.seq.store(m_seq, std::memory_order_release);
+		m_header->latest.store((m_seq << SLOT_BITS) | index, std::memory_order_release);
+		return true;
+	}
+
+	return false;
+}
+
+FrameRingReader::~FrameRingReader() {
+	if (m_mem != nullptr) {
+		pthread_mutex_unlock(&m_header->reader_locks[m_reader]);
+		munmap(m_mem, m_size);
+	}
+}
+
+bool FrameRingReader::open(const std::string& name) {
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) || (usize) st.st_size < sizeof(FrameRingHeader)) {
+		close(fd);
+		return false;
+	}
+
+	// reference counts live in the segment, so readers need write access too
+	void *mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) return false;
+
+	auto header = static_cast<FrameRingHeader *>(mem);
+	bool valid = header->magic == FRAME_RING_MAGIC && header->version == FRAME_RING_VERSION;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (!valid || header->data_offset + header->slot_count * header->slot_size > (u64) st.st_size) {
+		munmap(mem, st.st_size);
+		return false;
+	}
+
+	// a reader releases its entry only once its leases are gone, so a claimed entry starts with no references,
+	// unless its last reader crashed and the producer hasn't reclaimed it yet, then they are cleared here
+	u32 reader = 0;
+	for (; reader < FRAME_RING_MAX_READERS; reader ++) {
+		int err = pthread_mutex_trylock(&header->reader_locks[reader]);
+		if (err == EOWNERDEAD) {
+			auto slots = reinterpret_cast<FrameRingSlot *>(static_cast<u8 *>(mem) + sizeof(FrameRingHeader));
+			for (u32 j = 0; j < header->slot_count; j ++) {
+				slots[j].refs[reader].store(0);
+			}
+			pthread_mutex_consistent(&header->reader_locks[reader]);
+			break;
+		}
+		if (err == 0) break;
+	}
+	if (reader == FRAME_RING_MAX_READERS) {
+		munmap(mem, st.st_size);
+		return false;
+	}
+
+	m_mem = static_cast<u8 *>(mem);
+	m_size = st.st_size;
+	m_header = header;
+	m_slots = reinterpret_cast<FrameRingSlot *>(m_mem + sizeof(FrameRingHeader));
+	m_reader = reader;
+	return true;
+}
+
+bool FrameRingReader::is_open() const {
+	return m_mem != nullptr;
+}
+
+bool FrameRingReader::read(FrameRingRef& out, long timeout_usec) {
+	long start_usec = get_usec();
+
+	for (;;) {
+		u64 latest = m_header->latest.load(std::memory_order_acquire);
+		u64 seq = latest >> SLOT_BITS;
+		u32 index = latest & ((1u << SLOT_BITS) - 1);
+
+		if (seq > m_last_seq) {
+			auto& slot = m_slots[index];
+			slot.refs[m_reader].fetch_add(1);
+			if (slot.seq.load() == seq) {
+				// frames published while this reader was busy are never seen, since only the newest one is read
+				if (m_last_seq != 0 && seq > m_last_seq + 1) {
+					static auto& skipped = metrics_counter("vision_ring_frames_skipped_total", "frames in the shared memory ring replaced before they were read");
+					skipped.add(seq - m_last_seq - 1);
+				}
+				m_last_seq = seq;
+
+				out.seq = seq;
+				out.capture_usec = slot.capture_usec.load(std::memory_order_relaxed);
+				u8 *data = m_mem + m_header->data_offset + index * m_header->slot_size;
+				out.image = cv::Mat(m_header->height, m_header->width, m_header->type, data, m_header->stride);
+				std::atomic<u32> *refs = &slot.refs[m_reader];
+				out.lease = std::shared_ptr<void>(nullptr, [refs] (void *) {
+					refs->fetch_sub(1);
+				});
+				return true;
+			}
+
+			// the producer started overwriting the slot, try again with the next frame
+			slot.refs[m_reader].fetch_sub(1);
+			continue;
+		}
+
+		if (get_usec() - start_usec > timeout_usec) return false;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "types.h"
+#include <opencv2/opencv.hpp>
+#include <pthread.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+static const u32 FRAME_RING_MAGIC = 0x56495246;
+static const u32 FRAME_RING_VERSION = 3;
+// readers that can have a ring open at once, each process reading counts once per open reader
+static const u32 FRAME_RING_MAX_READERS = 16;
+
+// metadata for a single frame slot in the ring
+struct FrameRingSlot {
+	// sequence number of the frame in this slot, 0 while the producer is writing to it
+	std::atomic<u64> seq;
+	// references each reader holds to the frame, the producer skips slots that are in use
+	// counted per reader so the references of a reader that crashed can be dropped
+	std::atomic<u32> refs[FRAME_RING_MAX_READERS];
+	std::atomic<i64> capture_usec;
+};
+
+// header at the start of the shared memory segment, followed by the slot metadata and then the page aligned frame data
+struct FrameRingHeader {
+	u32 magic;
+	u32 version;
+	u32 slot_count;
+	u32 width;
+	u32 height;
+	// opencv type of the frames, usually CV_8UC3
+	u32 type;
+	u64 stride;
+	u64 slot_size;
+	u64 data_offset;
+	// newest complete frame, packed as (seq << 16) | slot index, 0 if nothing has been written yet
+	std::atomic<u64> latest;
+	// held by the reader using each entry of FrameRingSlot::refs, robust and process shared, so when the reader exits
+	// without releasing it the kernel marks it as abandoned, whatever pid namespace the reader runs in
+	pthread_mutex_t reader_locks[FRAME_RING_MAX_READERS];
+};
+
+// publishes frames from a single producer into a shared memory ring
+class FrameRingWriter {
+	public:
+		FrameRingWriter() = default;
+		~FrameRingWriter();
+
+		// replaces any existing ring with the same name, name must start with a '/'
+		bool open(const std::string& name, u32 slot_count, int width, int height, int type);
+		bool is_open() const;
+
+		// copies the frame into a free slot, returns false if the frame doesn't fit or every slot is being read
+		// when a slot is in use, references held by readers which exited without closing the ring are dropped first
+		bool write(const cv::Mat& frame, long capture_usec);
+
+	private:
+		// frees the entries of readers whose lock was abandoned, returns how many there were
+		u32 reclaim_dead_readers();
+
+		std::string m_name;
+		u8 *m_mem { nullptr };
+		usize m_size { 0 };
+		FrameRingHeader *m_header { nullptr };
+		FrameRingSlot *m_slots { nullptr };
+
+		u64 m_seq { 0 };
+		u32 m_next_slot { 0 };
+};
+
+// a frame read from the ring, image points directly into shared memory
+// the slot is not overwritten by the producer until the last copy of lease is destroyed
+struct FrameRingRef {
+	cv::Mat image;
+	u64 seq;
+	long capture_usec;
+	std::shared_ptr<void> lease;
+};
+
+// reads frames from a ring without copying them, up to FRAME_RING_MAX_READERS readers can share one ring
+// the reader must outlive the leases of every frame it returned, and must be opened and destroyed on the same thread,
+// which has to live as long as the reader, since the producer takes the exit of that thread as the reader crashing
+class FrameRingReader {
+	public:
+		FrameRingReader() = default;
+		~FrameRingReader();
+
+		// fails if the ring doesn't exist, was made by an incompatible version, or already has FRAME_RING_MAX_READERS readers
+		bool open(const std::string& name);
+		bool is_open() const;
+
+		// waits for a frame newer than the last one returned, gives up after timeout_usec and returns false
+		bool read(FrameRingRef& out, long timeout_usec);
+
+	private:
+		u8 *m_mem { nullptr };
+		usize m_size { 0 };
+		FrameRingHeader *m_header { nullptr };
+		FrameRingSlot *m_slots { nullptr };
+		// entry of FrameRingHeader::reader_locks this reader holds
+		u32 m_reader { 0 };
+
+		u64 m_last_seq { 0 };
+};
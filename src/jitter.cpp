@@ -0,0 +1,70 @@
+#include "jitter.h"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+JitterStats::JitterStats(usize max_samples)
+: m_max_samples(std::max(max_samples, (usize) 1))
+{
+	m_period.reserve(m_max_samples);
+	m_processing.reserve(m_max_samples);
+}
+
+void JitterStats::record(long period_usec, long processing_usec) {
+	if (m_period.size() < m_max_samples) {
+		m_period.push_back(period_usec);
+		m_processing.push_back(processing_usec);
+	} else {
+		m_period[m_next] = period_usec;
+		m_processing[m_next] = processing_usec;
+	}
+	m_next = (m_next + 1) % m_max_samples;
+	m_total ++;
+}
+
+static long percentile(const std::vector<long>& sorted, double p) {
+	usize index = std::min((usize) (p * (sorted.size() - 1) + 0.5), sorted.size() - 1);
+	return sorted[index];
+}
+
+static void report_distribution(const char *name, std::vector<long> samples) {
+	if (samples.empty()) return;
+	std::sort(samples.begin(), samples.end());
+
+	double mean = 0.0;
+	for (long sample : samples) mean += sample;
+	mean /= samples.size();
+
+	double variance = 0.0;
+	for (long sample : samples) variance += (sample - mean) * (sample - mean);
+	double stddev = sqrt(variance / samples.size());
+
+	printf("%s (usec): min %ld  p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  max %ld  mean %.1f  stddev %.1f\n",
+		name, samples.front(), percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99),
+		percentile(samples, 0.999), samples.back(), mean, stddev);
+
+	// power of two buckets, so outliers stand out even when they are rare
+	usize buckets[64] {};
+	int max_bucket = 0;
+	for (long sample : samples) {
+		int bucket = 0;
+		while (bucket < 63 && (1L << (bucket + 1)) <= sample) bucket ++;
+		buckets[bucket] ++;
+		max_bucket = std::max(max_bucket, bucket);
+	}
+
+	usize largest = *std::max_element(buckets, buckets + 64);
+	for (int bucket = 0; bucket <= max_bucket; bucket ++) {
+		if (buckets[bucket] == 0) continue;
+
+		int bar = (int) (50 * buckets[bucket] / largest);
+		printf("  %8ld - %8ld: %8zu %.*s\n", bucket == 0 ? 0L : 1L << bucket, (1L << (bucket + 1)) - 1, buckets[bucket], std::max(bar, 1),
+			"##################################################");
+	}
+}
+
+void JitterStats::report() const {
+	printf("jitter report over the last %zu of %lu frames\n", m_period.size(), (unsigned long) m_total);
+	report_distribution("frame period", m_period);
+	report_distribution("processing time", m_processing);
+}
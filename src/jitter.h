@@ -0,0 +1,23 @@
+#pragma once
+
+#include "types.h"
+#include <vector>
+
+// collects frame period and processing time samples to report their distribution
+// storage is allocated up front, once it is full the oldest samples are overwritten
+class JitterStats {
+	public:
+		explicit JitterStats(usize max_samples = 100000);
+
+		void record(long period_usec, long processing_usec);
+
+		// prints percentiles and a histogram of both distributions to stdout
+		void report() const;
+
+	private:
+		usize m_max_samples;
+		usize m_next { 0 };
+		u64 m_total { 0 };
+		std::vector<long> m_period;
+		std::vector<long> m_processing;
+};
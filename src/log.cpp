@@ -0,0 +1,194 @@
+#include "log.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+	// single producer single consumer ring buffer, written by one thread and read by the logging thread
+	class LogRing {
+		public:
+			static constexpr u64 CAPACITY = 1024;
+
+			bool push(const LogRecord& record) {
+				u64 head = m_head.load(std::memory_order_relaxed);
+				if (head - m_tail.load(std::memory_order_acquire) >= CAPACITY) {
+					return false;
+				}
+
+				m_records[head & (CAPACITY - 1)] = record;
+				m_head.store(head + 1, std::memory_order_release);
+				return true;
+			}
+
+			template<typename F>
+			void drain(F func) {
+				u64 tail = m_tail.load(std::memory_order_relaxed);
+				u64 head = m_head.load(std::memory_order_acquire);
+				for (; tail != head; tail ++) {
+					func(m_records[tail & (CAPACITY - 1)]);
+				}
+				m_tail.store(tail, std::memory_order_release);
+			}
+
+			// set when the owning thread exits, the logging thread frees the ring once it is drained
+			std::atomic<bool> retired { false };
+
+		private:
+			LogRecord m_records[CAPACITY];
+			alignas(64) std::atomic<u64> m_head { 0 };
+			alignas(64) std::atomic<u64> m_tail { 0 };
+	};
+
+	struct RingHandle {
+		LogRing *ring { nullptr };
+
+		~RingHandle() {
+			if (ring != nullptr) ring->retired.store(true, std::memory_order_release);
+		}
+	};
+
+	thread_local RingHandle t_ring;
+
+	// never destroyed, threads still running while the process exits may log after static destructors have run
+	std::mutex& g_rings_lock = *new std::mutex;
+	std::vector<LogRing *>& g_rings = *new std::vector<LogRing *>;
+
+	std::atomic<bool> g_running { false };
+	std::atomic<bool> g_stop { false };
+	std::atomic<u8> g_level { (u8) LogLevel::Info };
+	std::atomic<u64> g_dropped { 0 };
+	std::thread g_thread;
+
+	const char *level_prefix(LogLevel level) {
+		switch (level) {
+			case LogLevel::Warn: return "warning: ";
+			case LogLevel::Error: return "error: ";
+			default: return "";
+		}
+	}
+
+	// formats everything currently in the rings, ordered by timestamp across threads
+	void flush_rings(std::vector<LogRecord>& batch, u64& reported_dropped) {
+		batch.clear();
+		{
+			std::lock_guard<std::mutex> guard(g_rings_lock);
+			for (auto it = g_rings.begin(); it != g_rings.end();) {
+				LogRing *ring = *it;
+				// read retired before draining, so nothing pushed before the thread exited is lost
+				bool retired = ring->retired.load(std::memory_order_acquire);
+				ring->drain([&] (const LogRecord& record) { batch.push_back(record); });
+
+				if (retired) {
+					delete ring;
+					it = g_rings.erase(it);
+				} else {
+					it ++;
+				}
+			}
+		}
+
+		std::stable_sort(batch.begin(), batch.end(), [] (const LogRecord& a, const LogRecord& b) {
+			return a.timestamp_usec < b.timestamp_usec;
+		});
+
+		char buf[256];
+		for (const auto& record : batch) {
+			record.format(record, buf, sizeof(buf));
+			fputs(level_prefix(record.level), stdout);
+			fputs(buf, stdout);
+			fputc('\n', stdout);
+		}
+
+		u64 dropped = g_dropped.load(std::memory_order_relaxed);
+		if (dropped != reported_dropped) {
+			printf("warning: log buffer full, dropped %lu records\n", (unsigned long) (dropped - reported_dropped));
+			reported_dropped = dropped;
+		}
+
+		if (!batch.empty()) fflush(stdout);
+	}
+
+	void log_thread() {
+		// log_init may be called after the calling thread got a real time policy
+		set_low_priority();
+		std::vector<LogRecord> batch;
+		u64 reported_dropped = 0;
+
+		while (!g_stop.load(std::memory_order_acquire)) {
+			flush_rings(batch, reported_dropped);
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		flush_rings(batch, reported_dropped);
+	}
+}
+
+void log_init(LogLevel level) {
+	if (g_running.load()) return;
+
+	log_set_level(level);
+	g_stop = false;
+	g_thread = std::thread(log_thread);
+	g_running = true;
+
+	// exit destroys g_thread, which terminates the process if it is still joinable,
+	// so every exit(1) after startup would abort without flushing the error printed before it
+	static bool registered = false;
+	if (!registered) {
+		registered = true;
+		atexit(log_shutdown);
+	}
+}
+
+void log_shutdown() {
+	if (!g_running.exchange(false)) return;
+
+	g_stop = true;
+	g_thread.join();
+}
+
+void log_set_level(LogLevel level) {
+	g_level.store((u8) level, std::memory_order_relaxed);
+}
+
+bool log_enabled(LogLevel level) {
+	return g_running.load(std::memory_order_relaxed) && (u8) level >= g_level.load(std::memory_order_relaxed);
+}
+
+std::optional<LogLevel> log_parse_level(const std::string& str) {
+	if (str == "debug") return LogLevel::Debug;
+	if (str == "info") return LogLevel::Info;
+	if (str == "warn") return LogLevel::Warn;
+	if (str == "error") return LogLevel::Error;
+	return {};
+}
+
+u64 log_dropped() {
+	return g_dropped.load(std::memory_order_relaxed);
+}
+
+void log_push(LogRecord& record) {
+	if (t_ring.ring == nullptr) {
+		// only happens once per thread
+		t_ring.ring = new LogRing();
+		std::lock_guard<std::mutex> guard(g_rings_lock);
+		g_rings.push_back(t_ring.ring);
+	}
+
+	record.timestamp_usec = get_usec();
+	if (!t_ring.ring->push(record)) {
+		g_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+bool log_rate_check(std::atomic<long>& last_usec, long interval_usec) {
+	long now = get_usec();
+	long last = last_usec.load(std::memory_order_relaxed);
+	if (now - last < interval_usec) return false;
+	// if another thread logged from the same call site at the same time only one of them wins
+	return last_usec.compare_exchange_strong(last, now, std::memory_order_relaxed);
+}
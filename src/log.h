@@ -0,0 +1,100 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <optional>
+#include <string>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+
+enum class LogLevel : u8 {
+	Debug,
+	Info,
+	Warn,
+	Error,
+};
+
+// fixed size record written by the hot path, it is formatted later on the logging thread
+struct LogRecord {
+	static constexpr usize ARGS_SIZE = 48;
+
+	long timestamp_usec;
+	LogLevel level;
+	// must be a string literal, only the pointer is stored
+	const char *fmt;
+	// instantiated for the argument types of the log call, unpacks args and formats them
+	void (*format)(const LogRecord& record, char *buf, usize len);
+	alignas(8) u8 args[ARGS_SIZE];
+};
+
+// starts the logging thread, until this is called log records are discarded
+// log_shutdown is also registered with atexit, so exiting without calling it still flushes and joins the thread
+void log_init(LogLevel level);
+// writes out all records which have been logged so far and stops the logging thread
+void log_shutdown();
+
+void log_set_level(LogLevel level);
+bool log_enabled(LogLevel level);
+std::optional<LogLevel> log_parse_level(const std::string& str);
+
+// amount of records dropped because a thread's ring buffer was full
+u64 log_dropped();
+
+// timestamps the record and copies it into the calling thread's ring buffer, never blocks
+void log_push(LogRecord& record);
+
+// returns true at most once every interval_usec for the given call site state
+bool log_rate_check(std::atomic<long>& last_usec, long interval_usec);
+
+namespace log_detail {
+	template<typename T>
+	T read_arg(const u8 *buf, usize& offset) {
+		T out;
+		memcpy(&out, buf + offset, sizeof(T));
+		offset += sizeof(T);
+		return out;
+	}
+
+	template<typename... Args>
+	void format_record(const LogRecord& record, char *buf, usize len) {
+		usize offset = 0;
+		// braced initialization guarantees the arguments are read from left to right
+		std::tuple<Args...> args { read_arg<Args>(record.args, offset)... };
+		std::apply([&] (auto... arg) {
+			snprintf(buf, len, record.fmt, arg...);
+		}, args);
+	}
+}
+
+// string arguments must be string literals or otherwise outlive the logging thread, since only the pointer is copied
+template<typename... Args>
+void log_write(LogLevel level, const char *fmt, Args... args) {
+	static_assert((std::is_trivially_copyable_v<Args> && ...), "log arguments must be trivially copyable");
+	static_assert((sizeof(Args) + ... + 0) <= LogRecord::ARGS_SIZE, "too many log arguments");
+
+	if (!log_enabled(level)) return;
+
+	LogRecord record;
+	record.level = level;
+	record.fmt = fmt;
+	record.format = log_detail::format_record<Args...>;
+
+	usize offset = 0;
+	((memcpy(record.args + offset, &args, sizeof(Args)), offset += sizeof(Args)), ...);
+
+	log_push(record);
+}
+
+#define LOG_DEBUG(...) log_write(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) log_write(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...) log_write(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) log_write(LogLevel::Error, __VA_ARGS__)
+
+// logs at most once every interval_usec from this call site, the rest are discarded
+#define LOG_RATE_LIMITED(level, interval_usec, ...) do { \
+	static std::atomic<long> log_last_usec_ { 0 }; \
+	if (log_enabled(level) && log_rate_check(log_last_usec_, interval_usec)) { \
+		log_write(level, __VA_ARGS__); \
+	} \
+} while (0)
@@ -2,13 +2,77 @@
 #include "argparse.hpp"
 #include "vision.h"
 #include "util.h"
+#include "pipeline.h"
+#include "parallel.h"
+#include "render.h"
+#include "log.h"
+#include "shm_result.h"
+#include "source.h"
+#include "synthetic.h"
+#include "debug_stream.h"
+#include "rt.h"
+#include "jitter.h"
+#include "reload.h"
+#include "metrics.h"
+#include "trace.h"
+#ifdef VISION_SOAK
+#include "soak.h"
+#endif
 #include <opencv2/opencv.hpp>
 #include <mosquitto.h>
+#include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <algorithm>
 #include <iostream>
+#include <memory>
+#include <atomic>
+
+// set by SIGINT or SIGTERM, so the main loop can stop and print its reports
+static std::atomic<bool> g_stop { false };
+
+static void handle_stop_signal(int) {
+	g_stop = true;
+}
+
+// set by SIGHUP, the reloader thread rebuilds the vision parameters from the config and template files
+static std::atomic<bool> g_reload { false };
+
+static void handle_reload_signal(int) {
+	g_reload = true;
+}
+
+// routes messages on the control topic to the reloader, it is the userdata of the mqtt client
+struct MqttControl {
+	std::string topic;
+	VisionReloader *reloader;
+};
+
+// called from mosquitto_loop on the publishing thread, so it only queues the message
+static void handle_mqtt_message(struct mosquitto *, void *userdata, const struct mosquitto_message *message) {
+	auto control = static_cast<MqttControl *>(userdata);
+	if (message->payloadlen > 0 && control->topic == message->topic) {
+		control->reloader->submit(std::string(static_cast<const char *>(message->payload), message->payloadlen));
+	}
+}
+
+// subscriptions don't survive a reconnect, so they are made again on every connect
+static void handle_mqtt_connect(struct mosquitto *client, void *userdata, int result) {
+	auto control = static_cast<MqttControl *>(userdata);
+	if (result == 0) {
+		mosquitto_subscribe(client, nullptr, control->topic.c_str(), 1);
+	}
+}
+
+static void write_trace(const std::string& file_name) {
+	if (file_name.empty()) return;
+	if (trace_write(file_name)) {
+		printf("trace written to '%s'\n", file_name.c_str());
+	} else {
+		printf("warning: could not write trace '%s'\n", file_name.c_str());
+	}
+}
 
 int main(int argc, char **argv) {
 	argparse::ArgumentParser program("vision", "0.1.0");
@@ -18,6 +82,31 @@ int main(int argc, char **argv) {
 		.default_value(false)
 		.implicit_value(true);
 
+	program.add_argument("--display-fps")
+		.help("maximum rate the display window is redrawn at")
+		.default_value(30)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--log-level")
+		.help("minimum level of per frame log messages to print: debug, info, warn or error")
+		.default_value(std::string {"info"});
+
+	program.add_argument("--stream")
+		.help("serve the annotated frame and mask as an mjpeg stream on this localhost port, 0 to disable")
+		.default_value(0)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--stream-fps")
+		.help("maximum rate of the mjpeg debug stream")
+		.default_value(10)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
 	program.add_argument("-m")
 		.help("publish distance and angle to mqtt broker")
 		.default_value(std::string {"localhost"});
@@ -33,6 +122,28 @@ int main(int argc, char **argv) {
 		.help("mqtt topic to publish data to")
 		.default_value(std::string {"PI/CV/SHOOT/DATA"});
 
+	program.add_argument("--metrics-topic")
+		.help("mqtt topic the metrics are published to as a retained json message")
+		.default_value(std::string {"PI/CV/SHOOT/STATS"});
+
+	program.add_argument("--metrics-interval")
+		.help("seconds between metrics exports, 0 to disable")
+		.default_value(10)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--metrics-file")
+		.help("also write the metrics to this file in the prometheus text format, for the node exporter textfile collector")
+		.default_value(std::string {});
+
+	program.add_argument("--shm")
+		.help("also write each result to the named posix shared memory segment, for consumers on the same machine")
+		.default_value(std::optional<std::string> {})
+		.action([] (const std::string& str) -> std::optional<std::string> {
+			return str;
+		});
+
 	program.add_argument("-f", "--fps")
 		.help("maximum frames per second")
 		.default_value(120)
@@ -61,6 +172,52 @@ int main(int argc, char **argv) {
 			return std::atoi(str.c_str());
 		});
 
+	program.add_argument("-k", "--inflight")
+		.help("amount of frames to process concurrently, results are still published in order")
+		.default_value(1)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("-i", "--incremental")
+		.help("only reprocess tiles of the frame that changed since the previous frame, for static cameras")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--tile-rows")
+		.help("rows in each tile of a frame handed to a worker thread, 0 to split frames into one strip per thread")
+		.default_value(DEFAULT_TILE_ROWS)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--extractor")
+		.help("how candidates are found in the mask, contours or blobs, blobs are labelled in parallel strips of --tile-rows rows")
+		.default_value(std::string {"contours"});
+
+	program.add_argument("--detector")
+		.help("what targets are recognized by, template for the template shape, or ball for the largest round blob measured by a circle fit")
+		.default_value(std::string {"template"});
+
+	program.add_argument("--class")
+		.help("extra colour to find targets in, as hmin,smin,vmin,hmax,smax,vmax, can be given up to 7 times, results are published to the mqtt topic with /1, /2 and so on appended")
+		.default_value(std::vector<std::string> {})
+		.append();
+
+	program.add_argument("--tile-size")
+		.help("tile size in pixels used for incremental processing")
+		.default_value(32)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--change-threshold")
+		.help("mean absolute pixel difference above which a tile is considered changed in incremental processing")
+		.default_value(8)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
 	program.add_argument("-c", "--camera")
 		.help("camera device file name to process, if no file name is given, use camera 0")
 		.default_value(std::optional<std::string> {})
@@ -68,8 +225,148 @@ int main(int argc, char **argv) {
 			return str;
 		});
 
+	program.add_argument("--mjpeg")
+		.help("capture the camera in mjpeg mode and decode frames with libjpeg, needed for --jpeg-scale and --jpeg-roi")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--jpeg-scale")
+		.help("with --mjpeg, decode frames at 1/n of the camera resolution, n is 1, 2, 4 or 8")
+		.default_value(1)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--jpeg-roi")
+		.help("with --mjpeg, only decode the region x,y,width,height of the frame, in camera pixels")
+		.default_value(std::string {});
+
+	program.add_argument("--synthetic")
+		.help("render synthetic frames at the camera resolution and frame rate instead of capturing, with a moving template shaped target whose position is checked against the results")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--synthetic-distractors")
+		.help("amount of distractor blobs in synthetic frames")
+		.default_value(8)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--synthetic-noise")
+		.help("standard deviation of the noise added to synthetic frames")
+		.default_value(4.0)
+		.action([] (const std::string& str) {
+			return std::atof(str.c_str());
+		});
+
+	program.add_argument("--synthetic-seed")
+		.help("seed for the distractors and noise of synthetic frames")
+		.default_value(1)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--ring")
+		.help("read frames from the named shared memory ring published by another process, instead of a camera")
+		.default_value(std::optional<std::string> {})
+		.action([] (const std::string& str) -> std::optional<std::string> {
+			return str;
+		});
+
+	program.add_argument("--ring-produce")
+		.help("don't process frames, only publish camera frames into the named shared memory ring for other processes")
+		.default_value(std::optional<std::string> {})
+		.action([] (const std::string& str) -> std::optional<std::string> {
+			return str;
+		});
+
+	program.add_argument("--ring-slots")
+		.help("amount of frame slots in the ring created by --ring-produce")
+		.default_value(8)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--rt-policy")
+		.help("real time scheduling policy for the capture and processing threads: fifo, rr or other")
+		.default_value(std::string {"other"});
+
+	program.add_argument("--rt-priority")
+		.help("real time priority used with --rt-policy fifo or rr")
+		.default_value(50)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--capture-cpus")
+		.help("cpus the capture thread may run on, like 0,2-3, with 1 frame in flight it also processes frames, but its parallel workers use --process-cpus")
+		.default_value(std::string {});
+
+	program.add_argument("--process-cpus")
+		.help("cpus the frame processing threads and their parallel workers may run on, any cpu if not given")
+		.default_value(std::string {});
+
+	program.add_argument("--mlock")
+		.help("lock all memory so processing never waits for a page fault")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--prefault")
+		.help("allocate and touch scratch buffers at the camera resolution before the first frame")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--jitter")
+		.help("print the distribution of frame periods and processing times on exit")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--trace")
+		.help("record a timeline of stages, strips, captures and publishes on every thread, written to this file on exit as chrome trace json for perfetto")
+		.default_value(std::string {});
+
+	program.add_argument("--perf-counters")
+		.help("count cycles, instructions, cache misses and branch misses per stage with hardware counters, printed on exit")
+		.default_value(false)
+		.implicit_value(true);
+
+#ifdef VISION_SOAK
+	program.add_argument("--soak")
+		.help("run for this many seconds, then exit with an error if memory, allocations, open files or latency trended upward, 0 to run until stopped")
+		.default_value(0)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--soak-window")
+		.help("seconds between the samples a soak test looks for trends in")
+		.default_value(10)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+#endif
+
+	program.add_argument("--template-cache")
+		.help("descriptor file the processed template is cached in, defaults to the template file name with .desc appended")
+		.default_value(std::string {});
+
+	program.add_argument("--no-template-cache")
+		.help("always process the template image, and don't write a descriptor")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--config")
+		.help("file with thresh_min, thresh_max, morph_size, max_match, extractor, detector, class and template settings, applied again whenever it changes or on SIGHUP")
+		.default_value(std::string {});
+
+	program.add_argument("--control-topic")
+		.help("mqtt topic to receive settings in the config file format on, or \"reload\" to reload everything")
+		.default_value(std::string {});
+
 	program.add_argument("template")
-		.help("template image file to process");
+		.help("template image file to process, not needed with --ring-produce")
+		.default_value(std::string {});
 
 	try {
 		program.parse_args (argc, argv);
@@ -84,21 +381,248 @@ int main(int argc, char **argv) {
 	const int cam_width = program.get<int>("-w");
 	const int cam_height = program.get<int>("-h");
 	const int threads = program.get<int>("-t");
+	const int inflight = program.get<int>("-k");
+	const bool incremental_flag = program.get<bool>("-i");
 
 	if (threads < 1) {
 		printf("error: can't use less than 1 thread");
 		exit(1);
 	}
+	if (inflight < 1) {
+		printf("error: can't process less than 1 frame at a time\n");
+		exit(1);
+	}
+	if (incremental_flag && inflight > 1) {
+		printf("error: incremental processing needs frames to be processed in order, it can't be used with more than 1 frame in flight\n");
+		exit(1);
+	}
+
+	IncrementalState incremental;
+	incremental.tile_size = program.get<int>("--tile-size");
+	incremental.change_threshold = program.get<int>("--change-threshold");
+	if (incremental.tile_size < 1) {
+		printf("error: tile size must be at least 1 pixel\n");
+		exit(1);
+	}
+	const int tile_rows = program.get<int>("--tile-rows");
+	if (tile_rows < 0) {
+		printf("error: tile rows can't be negative\n");
+		exit(1);
+	}
+	auto extractor = parse_extractor(program.get("--extractor"));
+	if (!extractor.has_value()) {
+		printf("error: extractor must be contours or blobs\n");
+		exit(1);
+	}
+	auto detector = parse_detector(program.get("--detector"));
+	if (!detector.has_value()) {
+		printf("error: detector must be template or ball\n");
+		exit(1);
+	}
+	std::vector<ColourClass> extra_classes;
+	for (const auto& str : program.get<std::vector<std::string>>("--class")) {
+		auto colour_class = parse_colour_class(str);
+		if (!colour_class.has_value()) {
+			printf("error: class needs six values from 0 to 255\n");
+			exit(1);
+		}
+		extra_classes.push_back(*colour_class);
+	}
+	if (extra_classes.size() >= MAX_COLOUR_CLASSES) {
+		printf("error: at most %zu classes can be given\n", MAX_COLOUR_CLASSES - 1);
+		exit(1);
+	}
+	if (incremental_flag && !extra_classes.empty()) {
+		printf("error: incremental processing only finds the target colour, it can't be used with extra classes\n");
+		exit(1);
+	}
+	const bool mjpeg_flag = program.get<bool>("--mjpeg");
+	const int jpeg_scale = program.get<int>("--jpeg-scale");
+	if (jpeg_scale != 1 && jpeg_scale != 2 && jpeg_scale != 4 && jpeg_scale != 8) {
+		printf("error: jpeg scale must be 1, 2, 4 or 8\n");
+		exit(1);
+	}
+	cv::Rect jpeg_roi;
+	if (!program.get("--jpeg-roi").empty()) {
+		char extra;
+		if (sscanf(program.get("--jpeg-roi").c_str(), "%d,%d,%d,%d%c", &jpeg_roi.x, &jpeg_roi.y, &jpeg_roi.width, &jpeg_roi.height, &extra) != 4
+			|| jpeg_roi.x < 0 || jpeg_roi.y < 0 || jpeg_roi.width < 1 || jpeg_roi.height < 1) {
+			printf("error: jpeg roi must be x,y,width,height\n");
+			exit(1);
+		}
+	}
+	if (!mjpeg_flag && (jpeg_scale != 1 || !jpeg_roi.empty())) {
+		printf("error: --jpeg-scale and --jpeg-roi need --mjpeg\n");
+		exit(1);
+	}
+	if (mjpeg_flag && (jpeg_scale != 1 || !jpeg_roi.empty()) && program.is_used("--ring-produce")) {
+		// the ring only carries images, consumers would measure targets as if they were full frames
+		printf("error: --jpeg-scale and --jpeg-roi can't be used with --ring-produce\n");
+		exit(1);
+	}
+	const bool synthetic_flag = program.get<bool>("--synthetic");
+	if (synthetic_flag && (program.is_used("--ring-produce") || program.is_used("--ring") || mjpeg_flag)) {
+		printf("error: --synthetic can't be used with --ring, --ring-produce or --mjpeg\n");
+		exit(1);
+	}
+	// size of the frames processing will see, for prefaulting
+	const cv::Size frame_size = jpeg_roi.empty()
+		? cv::Size(cam_width / jpeg_scale, cam_height / jpeg_scale)
+		: cv::Size(jpeg_roi.width / jpeg_scale, jpeg_roi.height / jpeg_scale);
 	cv::setNumThreads(threads);
 
+	auto log_level = log_parse_level(program.get("--log-level"));
+	if (!log_level.has_value()) {
+		printf("error: unknown log level '%s'\n", program.get("--log-level").c_str());
+		exit(1);
+	}
+	log_init(*log_level);
+
+	auto rt_policy = rt_parse_policy(program.get("--rt-policy"));
+	if (!rt_policy.has_value()) {
+		printf("error: unknown scheduling policy '%s'\n", program.get("--rt-policy").c_str());
+		exit(1);
+	}
+
+	auto capture_cpus = rt_parse_cpus(program.get("--capture-cpus"));
+	auto process_cpus = rt_parse_cpus(program.get("--process-cpus"));
+	if (!capture_cpus.has_value() || !process_cpus.has_value()) {
+		printf("error: invalid cpu list\n");
+		exit(1);
+	}
+
+	const RtConfig capture_rt { *rt_policy, program.get<int>("--rt-priority"), *capture_cpus };
+	const RtConfig process_rt { *rt_policy, program.get<int>("--rt-priority"), *process_cpus };
+	const bool prefault_flag = program.get<bool>("--prefault");
+	const bool jitter_flag = program.get<bool>("--jitter");
+	const auto trace_file = program.get("--trace");
+	if (!trace_file.empty()) {
+		trace_start();
+	}
+	// only checked on this thread, every other thread opens its own counters when it first runs a stage
+	if (program.get<bool>("--perf-counters")) {
+		std::string error;
+		if (!perf_counters_start(error)) {
+			printf("warning: hardware counters unavailable: %s, continuing without them\n", error.c_str());
+		}
+	}
+
+	// processing and worker threads are started from the capture thread, so they are given their own settings
+	// instead of inheriting its cpus, any cpu the process started with if no processing cpus are given
+	RtConfig worker_rt = process_rt;
+	if (worker_rt.cpus.empty()) worker_rt.cpus = rt_current_cpus();
+	parallel_set_worker_start([worker_rt] () {
+		rt_apply_thread(worker_rt, "worker");
+	});
+	// opencv starts its own pool on first use, so it is started now, before the capture settings apply to this thread
+	cv::parallel_for_(cv::Range(0, cv::getNumThreads()), [] (const cv::Range&) {});
+
+	// the main thread captures frames, background threads created later switch themselves to low priority
+	rt_apply_thread(capture_rt, "capture");
+	if (program.get<bool>("--mlock")) {
+		rt_lock_memory();
+	}
+
+	signal(SIGINT, handle_stop_signal);
+	signal(SIGTERM, handle_stop_signal);
+	signal(SIGHUP, handle_reload_signal);
+
+	MetricsExporter metrics_exporter;
+	const int metrics_interval = program.get<int>("--metrics-interval");
+	if (metrics_interval > 0) {
+		metrics_exporter.start(metrics_interval, program.get("--metrics-file"));
+	}
+
+	std::unique_ptr<FrameSource> source;
+	auto ring_name = program.get<std::optional<std::string>>("--ring");
+	if (ring_name.has_value()) {
+		auto ring_source = std::make_unique<RingSource>();
+		if (!ring_source->open(*ring_name)) {
+			printf("error: could not open frame ring '%s'\n", ring_name->c_str());
+			exit(1);
+		}
+		source = std::move(ring_source);
+	} else if (synthetic_flag) {
+		// made once the template is loaded, since its shape is drawn as the target
+	} else if (mjpeg_flag) {
+		auto mjpeg_source = std::make_unique<MjpegSource>();
+		if (!mjpeg_source->open(program.get<std::optional<std::string>>("-c"), cam_width, cam_height, max_fps, jpeg_scale, jpeg_roi)) {
+			printf("error: could not open camera\n");
+			exit(1);
+		}
+		source = std::move(mjpeg_source);
+	} else {
+		auto camera_source = std::make_unique<CameraSource>();
+		if (!camera_source->open(program.get<std::optional<std::string>>("-c"), cam_width, cam_height, max_fps)) {
+			printf("error: could not open camera\n");
+			exit(1);
+		}
+		source = std::move(camera_source);
+	}
+
+	// time blocked waiting for the camera shows up in traces as capture spans
+	auto read_frame = [&] (Frame& frame) {
+		TRACE_SCOPE("Capture");
+		return source->read(frame);
+	};
+
+	auto produce_name = program.get<std::optional<std::string>>("--ring-produce");
+	if (produce_name.has_value()) {
+		// the ring is created once the first frame shows the real resolution the camera picked
+		FrameRingWriter ring_writer;
+		Frame frame;
+		while (!g_stop && read_frame(frame)) {
+			if (!ring_writer.is_open() && !ring_writer.open(*produce_name, program.get<int>("--ring-slots"), frame.image.cols, frame.image.rows, frame.image.type())) {
+				printf("error: could not create frame ring '%s'\n", produce_name->c_str());
+				exit(1);
+			}
+
+			if (!ring_writer.write(frame.image, frame.capture_usec)) {
+				static auto& dropped = metrics_counter("vision_ring_frames_dropped_total", "captured frames dropped because every frame ring slot was in use");
+				dropped.add();
+				LOG_RATE_LIMITED(LogLevel::Warn, 1000000, "every frame ring slot is in use, dropping frame");
+			}
+		}
+
+		write_trace(trace_file);
+		log_shutdown();
+		return 0;
+	}
+
+	bool stand_in_flag = false;
+#ifdef VISION_SOAK
+	const int soak_sec = program.get<int>("--soak");
+	const int soak_window_sec = program.get<int>("--soak-window");
+	if (soak_sec < 0 || soak_window_sec < 1) {
+		printf("error: soak time can't be negative and the soak window must be at least 1 second\n");
+		exit(1);
+	}
+	// without a broker to publish to, a soak test publishes to a stand in, so the mqtt path is still exercised
+	MqttStandIn mqtt_stand_in;
+	stand_in_flag = soak_sec > 0 && !program.is_used("-m");
+	if (stand_in_flag && !mqtt_stand_in.start()) {
+		printf("error: could not start the mqtt stand in for the soak test\n");
+		exit(1);
+	}
+#endif
+
 	// TODO: maybe it is ugly to have a boolean and mqtt_client, maybe use an optional?
-	const bool mqtt_flag = program.is_used("-m");
+	const bool mqtt_flag = program.is_used("-m") || stand_in_flag;
 	const auto mqtt_topic = program.get("-t");
+	// made for every class up front, since a reload can add classes
+	std::vector<std::string> class_topics;
+	for (usize i = 1; i < MAX_COLOUR_CLASSES; i ++) {
+		class_topics.push_back(mqtt_topic + "/" + std::to_string(i));
+	}
 	// XXX: if mqtt_flag is set, this is guaranteed to be a valid pointer
 	struct mosquitto *mqtt_client = nullptr;
 	if (mqtt_flag) {
-		auto host_name = program.get("-m");
+		auto host_name = stand_in_flag ? std::string {"127.0.0.1"} : program.get("-m");
+#ifdef VISION_SOAK
+		const int mqtt_port = stand_in_flag ? mqtt_stand_in.port() : program.get<int>("-p");
+#else
 		const int mqtt_port = program.get<int>("-p");
+#endif
 		auto client_name = std::string {"vision_"} + std::to_string(getpid());
 
 		mosquitto_lib_init();
@@ -114,32 +638,105 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	cv::VideoCapture cap;
-	auto file_name = program.get<std::optional<std::string>>("-c");
-	if (file_name.has_value()) {
-		cap.open(*file_name, cv::CAP_V4L2);
-	} else {
-		// cv::CAP_V4L2 is needed because by default it might use gstreamer, and because of a bug in opencv, this causes open to fail
-		// if this is ever run not on linux, this will likely need to be changed
-		cap.open(0, cv::CAP_V4L2);
-		cap.set(cv::CAP_PROP_FRAME_WIDTH, cam_width);
-		cap.set(cv::CAP_PROP_FRAME_HEIGHT, cam_height);
-		cap.set(cv::CAP_PROP_FPS, max_fps);
+	auto config_file = program.get("--config");
+	VisionConfig config;
+	if (!config_file.empty()) {
+		std::string error;
+		auto file_config = read_vision_config(config_file, error);
+		if (!file_config.has_value()) {
+			printf("error: %s\n", error.c_str());
+			exit(1);
+		}
+		config = *file_config;
+	}
+
+	auto template_file = config.template_file.value_or(program.get("template"));
+	if (template_file.empty()) {
+		printf("error: a template image is needed to process frames\n");
+		exit(1);
 	}
 
-	if (!cap.isOpened()) {
-		printf("error: could not open camera\n");
+	const bool cache_flag = !program.get<bool>("--no-template-cache");
+	std::string cache_file;
+	if (cache_flag) {
+		cache_file = program.get("--template-cache");
+		if (cache_file.empty()) cache_file = template_file + ".desc";
+	}
+
+	std::optional<Vision> vis_storage;
+	try {
+		VisionParams settings;
+		settings.extractor = *extractor;
+		settings.detector = *detector;
+		settings.extra_classes = extra_classes;
+		apply_vision_config(config, settings);
+		auto params = load_vision_params(template_file, cache_file, std::move(settings));
+		// the mask is only there if the template had to be processed, not when it came from the descriptor cache
+		if (display_flag && !params.template_mask.empty()) {
+			cv::imshow("Template", params.template_mask);
+			cv::waitKey();
+			// later frames are drawn by the debug render thread, which should own all open windows
+			cv::destroyWindow("Template");
+		}
+		vis_storage.emplace(std::move(params), threads);
+		vis_storage->set_tile_rows(tile_rows);
+	} catch (const std::runtime_error& err) {
+		printf("error: %s\n", err.what());
 		exit(1);
 	}
+	const Vision& vis = *vis_storage;
+
+	if (synthetic_flag) {
+		SyntheticSettings synthetic;
+		synthetic.width = cam_width;
+		synthetic.height = cam_height;
+		synthetic.fps = max_fps;
+		synthetic.distractors = program.get<int>("--synthetic-distractors");
+		synthetic.noise = program.get<double>("--synthetic-noise");
+		synthetic.seed = program.get<int>("--synthetic-seed");
 
+		auto synthetic_source = std::make_unique<SyntheticSource>();
+		synthetic_source->open(synthetic, vis.params());
+		source = std::move(synthetic_source);
+	}
 
-	auto template_file = program.get("template");
-	auto template_img = cv::imread(template_file, -1);
-	if (template_img.empty()) {
-		printf("template file '%s' empty or missing\n", template_file.c_str());
+	ReloadSettings reload_settings;
+	reload_settings.template_file = template_file;
+	reload_settings.config_file = config_file;
+	reload_settings.use_cache = cache_flag;
+	reload_settings.cache_file = program.get("--template-cache");
+	VisionReloader reloader(*vis_storage, reload_settings, g_reload);
+
+	MqttControl mqtt_control { program.get("--control-topic"), &reloader };
+	if (mqtt_flag && !mqtt_control.topic.empty()) {
+		mosquitto_user_data_set(mqtt_client, &mqtt_control);
+		mosquitto_message_callback_set(mqtt_client, handle_mqtt_message);
+		mosquitto_connect_callback_set(mqtt_client, handle_mqtt_connect);
+	}
+
+	ShmResultWriter shm_writer;
+	auto shm_name = program.get<std::optional<std::string>>("--shm");
+	if (shm_name.has_value() && !shm_writer.open(*shm_name)) {
+		printf("error: could not open shared memory segment '%s'\n", shm_name->c_str());
 		exit(1);
 	}
-	Vision vis(template_img, threads, display_flag);
+
+	std::unique_ptr<DebugRenderer> renderer;
+	if (display_flag) {
+		renderer = std::make_unique<DebugRenderer>(program.get<int>("--display-fps"));
+	}
+
+	DebugStream stream;
+	const int stream_port = program.get<int>("--stream");
+	if (stream_port != 0 && !stream.open(stream_port, program.get<int>("--stream-fps"))) {
+		printf("error: could not listen on port %d for the debug stream\n", stream_port);
+		exit(1);
+	}
+
+	// snapshots are only worth capturing if something will draw them
+	auto capture_debug = [&] () {
+		return renderer != nullptr || stream.wanted();
+	};
 
 	const usize msg_len = 32;
 	char msg[msg_len];
@@ -147,26 +744,111 @@ int main(int argc, char **argv) {
 
 	long total_time = 0;
 	long frames = 0;
+	long last_result_usec = get_usec();
 
-	for (;;) {
-		cv::Mat frame;
-		cap >> frame;
-		if (frame.empty()) break;
+	JitterStats jitter;
 
-		long elapsed_time;
-		auto target = time<std::optional<Target>>("frame", [&] () {
-			return vis.process(frame);
-		}, &elapsed_time);
+	auto& frames_metric = metrics_counter("vision_frames_total", "frames processed");
+	auto& detections_metric = metrics_counter("vision_detections_total", "frames the target was found in");
+	auto& detection_rate_metric = metrics_gauge("vision_detection_rate", "share of recent frames the target was found in, averaged over about 100 frames");
+	auto& fps_metric = metrics_gauge("vision_fps", "instantaneous frames per second");
+	auto& average_fps_metric = metrics_gauge("vision_fps_average", "average frames per second since start");
+	auto& in_flight_metric = metrics_gauge("vision_frames_in_flight", "frames submitted for processing but not yet published");
+	auto& publish_failures_metric = metrics_counter("vision_mqtt_publish_failures_total", "results mosquitto failed to queue for publishing");
+	auto& reconnects_metric = metrics_counter("vision_mqtt_reconnects_total", "reconnects after losing the mqtt connection");
+	const auto metrics_topic = program.get("--metrics-topic");
+	double detection_rate = 0.0;
+	long last_capture_usec = 0;
+
+	// a detection is a hit if it overlaps the true bounding box by at least half of their union
+	auto& hits_metric = metrics_counter("vision_truth_frames_total", "frames with a known target position, by whether the result matched it", "hit", "outcome");
+	auto& misses_metric = metrics_counter("vision_truth_frames_total", "", "miss", "outcome");
+	auto& false_positives_metric = metrics_counter("vision_truth_frames_total", "", "false_positive", "outcome");
+	auto& true_negatives_metric = metrics_counter("vision_truth_frames_total", "", "true_negative", "outcome");
+	double center_error_sum = 0.0;
+	auto record_accuracy = [&] (const FrameResult& result) {
+		const auto& target = result.target;
+		if (result.truth.empty()) {
+			(target.has_value() ? false_positives_metric : true_negatives_metric).add();
+			return;
+		}
+
+		double overlap = target.has_value() ? (result.truth & target->rect).area() : 0.0;
+		double iou = target.has_value() ? overlap / (result.truth.area() + target->rect.area() - overlap) : 0.0;
+		if (iou < 0.5) {
+			misses_metric.add();
+			return;
+		}
+		hits_metric.add();
+		double dx = (result.truth.x + result.truth.width / 2.0) - (target->rect.x + target->rect.width / 2.0);
+		double dy = (result.truth.y + result.truth.height / 2.0) - (target->rect.y + target->rect.height / 2.0);
+		center_error_sum += sqrt(dx * dx + dy * dy);
+	};
+
+#ifdef VISION_SOAK
+	std::optional<SoakMonitor> soak_monitor;
+	if (soak_sec > 0) {
+		soak_monitor.emplace(soak_sec, soak_window_sec);
+	}
+#endif
+
+	auto publish_result = [&] (const FrameResult& result) {
+		// when multiple frames are in flight they overlap, so processing time alone overestimates fps
+		long now_usec = get_usec();
+		long elapsed_time = inflight > 1 ? now_usec - last_result_usec : result.elapsed_usec;
+		last_result_usec = now_usec;
+		elapsed_time = std::max(elapsed_time, 1L);
 
 		total_time += elapsed_time;
 		frames ++;
 
-		printf("instantaneous fps: %ld\n", std::min(1000000 / elapsed_time, max_fps));
-		printf("average fps: %ld\n", std::min(1000000 * frames / total_time, max_fps));
+		if (result.has_truth) {
+			record_accuracy(result);
+		}
+#ifdef VISION_SOAK
+		if (soak_monitor.has_value() && !soak_monitor->record(result.elapsed_usec)) {
+			g_stop = true;
+		}
+#endif
+
+		if (jitter_flag) {
+			if (last_capture_usec != 0) {
+				jitter.record(result.capture_usec - last_capture_usec, result.elapsed_usec);
+			}
+			last_capture_usec = result.capture_usec;
+		}
 
-		printf("\n");
+		LOG_INFO("instantaneous fps: %ld", std::min(1000000 / elapsed_time, max_fps));
+		LOG_INFO("average fps: %ld", std::min(1000000 * frames / total_time, max_fps));
+
+		frames_metric.add();
+		if (result.target.has_value()) detections_metric.add();
+		detection_rate += ((result.target.has_value() ? 1.0 : 0.0) - detection_rate) * 0.01;
+		detection_rate_metric.set(detection_rate);
+		fps_metric.set(std::min(1000000 / elapsed_time, max_fps));
+		average_fps_metric.set(std::min(1000000 * frames / total_time, max_fps));
+
+		if (renderer != nullptr) {
+			renderer->submit(result.debug);
+		}
+		stream.publish(result.debug);
+
+		const auto& target = result.target;
+		if (shm_writer.is_open()) {
+			ShmResult shm_result {};
+			shm_result.frame = frames;
+			shm_result.capture_usec = result.capture_usec;
+			shm_result.publish_usec = get_usec();
+			shm_result.found = target.has_value();
+			if (target.has_value()) {
+				shm_result.distance = target->distance;
+				shm_result.angle = target->angle;
+			}
+			shm_writer.write(shm_result);
+		}
 
 		if (mqtt_flag) {
+			TRACE_SCOPE("Publish");
 			if (target.has_value()) {
 				snprintf(msg, msg_len, "1 %6.2f %6.2f", target->distance, target->angle);
 			}
@@ -174,21 +856,125 @@ int main(int argc, char **argv) {
 				snprintf(msg, msg_len, "0 %6.2f %6.2f", 0.0f, 0.0f);
 			}
 
-			mosquitto_publish(mqtt_client, 0, mqtt_topic.c_str(), strlen(msg), msg, 0, false);
+			if (mosquitto_publish(mqtt_client, 0, mqtt_topic.c_str(), strlen(msg), msg, 0, false)) {
+				publish_failures_metric.add();
+			}
+			for (usize i = 0; i < result.class_targets.size() && i < class_topics.size(); i ++) {
+				const auto& class_target = result.class_targets[i];
+				snprintf(msg, msg_len, "%d %6.2f %6.2f", class_target.has_value(), class_target.has_value() ? class_target->distance : 0.0, class_target.has_value() ? class_target->angle : 0.0);
+				if (mosquitto_publish(mqtt_client, 0, class_topics[i].c_str(), strlen(msg), msg, 0, false)) {
+					publish_failures_metric.add();
+				}
+			}
+
+			// retained, so a dashboard subscribing later gets the latest stats straight away
+			auto stats = metrics_exporter.take_payload();
+			if (!stats.empty()) {
+				mosquitto_publish(mqtt_client, nullptr, metrics_topic.c_str(), stats.size(), stats.data(), 0, true);
+			}
+
 			int ret = mosquitto_loop(mqtt_client, 0, 1);
-			printf("message sent: %s\n", msg);
+			if (target.has_value()) {
+				LOG_DEBUG("message sent: 1 %6.2f %6.2f", target->distance, target->angle);
+			} else {
+				LOG_DEBUG("message sent: 0 %6.2f %6.2f", 0.0, 0.0);
+			}
 			if (ret) {
-				printf("connection lost, reconnecting...\n");
+				LOG_RATE_LIMITED(LogLevel::Warn, 1000000, "connection lost, reconnecting...");
 				mosquitto_reconnect(mqtt_client);
+				reconnects_metric.add();
+			}
+		}
+	};
+
+	if (inflight == 1) {
+		VisionContext ctx;
+		if (prefault_flag) {
+			vis.prefault(ctx, frame_size);
+		}
+
+		Frame frame;
+		while (!g_stop && read_frame(frame)) {
+			ctx.capture_debug = capture_debug();
+			ctx.scale = frame.scale;
+			ctx.offset = frame.offset;
+			FrameResult result;
+			result.capture_usec = frame.capture_usec;
+			result.has_truth = frame.has_truth;
+			result.truth = frame.truth;
+			result.target = time<std::optional<Target>>("frame", [&] () {
+				if (incremental_flag) {
+					return vis.process_incremental(frame.image, ctx, incremental);
+				} else {
+					return vis.process(frame.image, ctx);
+				}
+			}, &result.elapsed_usec);
+			result.debug = std::move(ctx.debug);
+			// the renderer draws the frame after the next one has been read, which may release this one's memory
+			if (result.debug != nullptr) result.debug->lease = frame.lease;
+			result.class_targets = ctx.class_targets;
+
+			if (incremental_flag) {
+				LOG_DEBUG("changed tiles: %zu/%zu", incremental.changed.size(), (size_t) incremental.total_tiles);
+			}
+
+			publish_result(result);
+		}
+	} else {
+		FramePipeline pipeline(vis, inflight, capture_debug(), [&] (VisionContext& ctx) {
+			rt_apply_thread(worker_rt, "processing");
+			if (prefault_flag) {
+				vis.prefault(ctx, frame_size);
+			}
+		});
+		while (!g_stop) {
+			pipeline.set_capture_debug(capture_debug());
+
+			// a new frame is needed every time, since the previous ones are still being processed
+			Frame frame;
+			if (!read_frame(frame)) break;
+
+			pipeline.submit(std::move(frame));
+			in_flight_metric.set(pipeline.in_flight());
+			if (pipeline.full()) {
+				publish_result(pipeline.next());
 			}
 		}
 
-		// this is necessary to poll events for opencv highgui
-		if (display_flag) cv::pollKey();
+		while (pipeline.in_flight() > 0) {
+			publish_result(pipeline.next());
+		}
+	}
+
+	if (jitter_flag) {
+		jitter.report();
+	}
+	perf_counters_report();
+	if (synthetic_flag) {
+		u64 hits = hits_metric.value();
+		u64 with_target = hits + misses_metric.value();
+		u64 without_target = false_positives_metric.value() + true_negatives_metric.value();
+		printf("synthetic accuracy: %llu/%llu targets found, mean center error %.2f pixels, %llu false detections in %llu frames without a target\n",
+			(unsigned long long) hits, (unsigned long long) with_target, hits > 0 ? center_error_sum / hits : 0.0,
+			(unsigned long long) false_positives_metric.value(), (unsigned long long) without_target);
 	}
 
+	bool soak_ok = true;
+#ifdef VISION_SOAK
+	if (soak_monitor.has_value()) {
+		soak_ok = soak_monitor->report();
+		if (stand_in_flag) {
+			printf("mqtt stand in received %llu messages\n", (unsigned long long) mqtt_stand_in.received());
+		}
+	}
+#endif
+
 	if (mqtt_flag) {
 		mosquitto_destroy(mqtt_client);
 		mosquitto_lib_cleanup();
 	}
+
+	write_trace(trace_file);
+	log_shutdown();
+	return soak_ok ? 0 : 2;
 }
@@ -0,0 +1,174 @@
+#include "matcher.h"
+#include "parallel.h"
+#include <float.h>
+#include <math.h>
+
+// same epsilon matchShapes uses to ignore hu moments that are too small to compare
+static const double HU_EPS = 1.e-5;
+
+// survivors below this count are scored on the calling thread, since spreading them out costs more than it saves
+static const usize PARALLEL_MIN_CANDIDATES = 64;
+// candidates per stolen chunk, computing moments of one contour is too little work to schedule on its own
+static const int PARALLEL_GRAIN = 16;
+
+// returns true if any hu moment is non zero, matchShapes treats shapes as incomparable if only one of them has any
+static bool signed_log_hu(const cv::Moments& moments, double *log_hu, bool *valid) {
+	double hu[7];
+	cv::HuMoments(moments, hu);
+
+	bool any_nonzero = false;
+	for (int i = 0; i < 7; i ++) {
+		any_nonzero |= hu[i] != 0.0;
+
+		double abs_hu = fabs(hu[i]);
+		valid[i] = abs_hu > HU_EPS;
+
+		double sign = hu[i] > 0 ? 1.0 : (hu[i] < 0 ? -1.0 : 0.0);
+		log_hu[i] = valid[i] ? sign * log10(abs_hu) : 0.0;
+	}
+	return any_nonzero;
+}
+
+TemplateFeatures make_template_features(std::vector<cv::Point> contour) {
+	TemplateFeatures out;
+	out.area_frac = cv::contourArea(contour) / cv::boundingRect(contour).area();
+
+	out.any_hu_nonzero = signed_log_hu(cv::moments(contour), out.log_hu, out.hu_valid);
+
+	out.contour = std::move(contour);
+	return out;
+}
+
+TemplateFeatures make_template_features(const Blob& blob, std::vector<cv::Point> contour) {
+	TemplateFeatures out;
+	out.area_frac = (double) blob.m00 / blob.rect().area();
+
+	out.any_hu_nonzero = signed_log_hu(blob.moments(), out.log_hu, out.hu_valid);
+
+	out.contour = std::move(contour);
+	return out;
+}
+
+usize CandidateTable::size() const {
+	return index.size();
+}
+
+void CandidateTable::clear() {
+	index.clear();
+	area.clear();
+	bbox_x.clear();
+	bbox_y.clear();
+	bbox_width.clear();
+	bbox_height.clear();
+	fill.clear();
+}
+
+void CandidateTable::resize_moments(usize len) {
+	for (int i = 0; i < 7; i ++) {
+		log_hu[i].resize(len);
+		hu_valid[i].resize(len);
+	}
+	any_hu_nonzero.resize(len);
+	score.resize(len);
+}
+
+// shared by contours and blobs, area_of and rect_of give the cheap features of candidate i, moments_of its moments
+template<typename AreaOf, typename RectOf, typename MomentsOf>
+static MatchResult match_table(usize count, AreaOf area_of, RectOf rect_of, MomentsOf moments_of, const TemplateFeatures& tmpl, CandidateTable& table, int threads, double max_match) {
+	table.clear();
+
+	// cheapest tests first: area and fill ratio only need the area and bounding box
+	for (usize i = 0; i < count; i ++) {
+		double area = area_of(i);
+		// the best candidate must have a larger area than the previous best, which starts at 0
+		if (area <= 0.0) continue;
+
+		auto rect = rect_of(i);
+		double fill = area / rect.area();
+		if (fabs(fill - tmpl.area_frac) / tmpl.area_frac >= 0.2) continue;
+
+		table.index.push_back(i);
+		table.area.push_back(area);
+		table.bbox_x.push_back(rect.x);
+		table.bbox_y.push_back(rect.y);
+		table.bbox_width.push_back(rect.width);
+		table.bbox_height.push_back(rect.height);
+		table.fill.push_back(fill);
+	}
+
+	usize len = table.size();
+	table.resize_moments(len);
+
+	// contour moments need a pass over every contour point, so they are only computed for survivors
+	auto compute_moments = [&] (const cv::Range& range) {
+		for (int j = range.start; j < range.end; j ++) {
+			double log_hu[7];
+			bool valid[7];
+			table.any_hu_nonzero[j] = signed_log_hu(moments_of(table.index[j]), log_hu, valid);
+
+			for (int i = 0; i < 7; i ++) {
+				table.log_hu[i][j] = log_hu[i];
+				table.hu_valid[i][j] = valid[i];
+			}
+		}
+	};
+
+	if (threads > 1 && len >= PARALLEL_MIN_CANDIDATES) {
+		parallel_for(len, PARALLEL_GRAIN, threads, [&] (int begin, int end) {
+			compute_moments(cv::Range(begin, end));
+		});
+	} else {
+		compute_moments(cv::Range(0, len));
+	}
+
+	// CONTOURS_MATCH_I3 is the largest relative difference of any hu moment valid in both contours
+	// the loops are branch free over contiguous columns so the compiler can vectorize them
+	double *score = table.score.data();
+	for (usize j = 0; j < len; j ++) {
+		score[j] = 0.0;
+	}
+	for (int i = 0; i < 7; i ++) {
+		if (!tmpl.hu_valid[i]) continue;
+
+		double tmpl_log_hu = tmpl.log_hu[i];
+		const double *log_hu = table.log_hu[i].data();
+		const u8 *valid = table.hu_valid[i].data();
+		for (usize j = 0; j < len; j ++) {
+			double diff = fabs((tmpl_log_hu - log_hu[j]) / tmpl_log_hu);
+			diff = valid[j] ? diff : 0.0;
+			score[j] = diff > score[j] ? diff : score[j];
+		}
+	}
+	for (usize j = 0; j < len; j ++) {
+		score[j] = (bool) table.any_hu_nonzero[j] != tmpl.any_hu_nonzero ? DBL_MAX : score[j];
+	}
+
+	// selection depends on the best candidate so far, so it is done in contour order like before
+	MatchResult out;
+	for (usize j = 0; j < len; j ++) {
+		if (score[j] < out.match && score[j] < max_match && table.area[j] > out.area) {
+			out.found = true;
+			out.index = table.index[j];
+			out.match = score[j];
+			out.area = table.area[j];
+		}
+	}
+
+	return out;
+}
+
+MatchResult match_candidates(const std::vector<std::vector<cv::Point>>& contours, const TemplateFeatures& tmpl, CandidateTable& table, int threads, double max_match) {
+	return match_table(contours.size(),
+		[&] (usize i) { return cv::contourArea(contours[i]); },
+		[&] (usize i) { return cv::boundingRect(contours[i]); },
+		[&] (usize i) { return cv::moments(contours[i]); },
+		tmpl, table, threads, max_match);
+}
+
+MatchResult match_blobs(const std::vector<Blob>& blobs, const TemplateFeatures& tmpl, CandidateTable& table, int threads, double max_match) {
+	return match_table(blobs.size(),
+		[&] (usize i) { return (double) blobs[i].m00; },
+		[&] (usize i) { return blobs[i].rect(); },
+		[&] (usize i) { return blobs[i].moments(); },
+		tmpl, table, threads, max_match);
+}
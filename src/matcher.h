@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+#include "blobs.h"
+#include <opencv2/opencv.hpp>
+#include <math.h>
+#include <vector>
+
+// features of the template contour, these are constant so they are only computed once
+struct TemplateFeatures {
+	std::vector<cv::Point> contour;
+	// contour area divided by bounding box area
+	double area_frac { 0.0 };
+	// signed log10 of each hu moment, as used by matchShapes
+	double log_hu[7] {};
+	// whether the absolute value of each hu moment is large enough to be compared
+	bool hu_valid[7] {};
+	bool any_hu_nonzero { false };
+};
+
+TemplateFeatures make_template_features(std::vector<cv::Point> contour);
+// for templates matched against blobs, the features are of the blob's pixels and the contour is only kept for drawing
+TemplateFeatures make_template_features(const Blob& blob, std::vector<cv::Point> contour);
+
+// features of candidate contours, stored as a structure of arrays so each filter and scoring pass only touches the columns it needs
+struct CandidateTable {
+	// index of the contour each row came from
+	std::vector<u32> index;
+	std::vector<double> area;
+	std::vector<int> bbox_x;
+	std::vector<int> bbox_y;
+	std::vector<int> bbox_width;
+	std::vector<int> bbox_height;
+	std::vector<double> fill;
+	std::vector<double> log_hu[7];
+	std::vector<u8> hu_valid[7];
+	std::vector<u8> any_hu_nonzero;
+	std::vector<double> score;
+
+	usize size() const;
+	void clear();
+	void resize_moments(usize len);
+};
+
+struct MatchResult {
+	bool found { false };
+	usize index { 0 };
+	double match { INFINITY };
+	double area { 0.0 };
+};
+
+// finds the contour that best matches the template
+// candidates are rejected by the cheapest tests first, and only survivors have their hu moments computed and scored
+// the result is the same as calling cv::matchShapes with CONTOURS_MATCH_I3 on every contour
+MatchResult match_candidates(const std::vector<std::vector<cv::Point>>& contours, const TemplateFeatures& tmpl, CandidateTable& table, int threads, double max_match = 1.5);
+// like match_candidates, but for blobs from extract_blobs, the area is the pixel count and the moments are of the blob's pixels
+MatchResult match_blobs(const std::vector<Blob>& blobs, const TemplateFeatures& tmpl, CandidateTable& table, int threads, double max_match = 1.5);
@@ -0,0 +1,326 @@
+#include "metrics.h"
+#include "util.h"
+#include "log.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <algorithm>
+#include <memory>
+
+enum class MetricType : u8 {
+	Counter,
+	Gauge,
+	Histogram,
+};
+
+enum SlotState : int {
+	SLOT_EMPTY,
+	SLOT_REGISTERING,
+	SLOT_READY,
+};
+
+// every slot can hold any type of metric, so registering one is claiming the next empty slot
+// each slot is on its own cache lines, stages recorded by different threads don't contend
+struct alignas(64) MetricSlot {
+	std::atomic<int> state { SLOT_EMPTY };
+	MetricType type { MetricType::Counter };
+	const char *name { nullptr };
+	const char *help { nullptr };
+	const char *label { nullptr };
+	const char *label_key { nullptr };
+
+	Counter counter;
+	Gauge gauge;
+	Histogram histogram;
+};
+
+static const usize MAX_METRICS = 256;
+static MetricSlot g_metrics[MAX_METRICS];
+// handed out once the registry is full, it is updated like any other metric but never exported
+static MetricSlot g_overflow;
+
+static const char *STAGE_HELP = "time spent in each processing stage in microseconds";
+
+static bool same_string(const char *a, const char *b) {
+	if (a == b) return true;
+	if (a == nullptr || b == nullptr) return false;
+	return strcmp(a, b) == 0;
+}
+
+static MetricSlot& find_metric(MetricType type, const char *name, const char *help, const char *label, const char *label_key) {
+	// string literals with the same contents are usually merged, so comparing pointers finds almost every metric
+	for (auto& slot : g_metrics) {
+		int state = slot.state.load(std::memory_order_acquire);
+		if (state == SLOT_EMPTY) break;
+		if (state == SLOT_READY && slot.name == name && slot.label == label) return slot;
+	}
+
+	for (auto& slot : g_metrics) {
+		int state = slot.state.load(std::memory_order_acquire);
+		if (state == SLOT_EMPTY && slot.state.compare_exchange_strong(state, SLOT_REGISTERING, std::memory_order_acq_rel)) {
+			slot.type = type;
+			slot.name = name;
+			slot.help = help;
+			slot.label = label;
+			slot.label_key = label_key;
+			slot.state.store(SLOT_READY, std::memory_order_release);
+			return slot;
+		}
+
+		// another thread claimed this slot first, it may be registering the same metric
+		while (state != SLOT_READY) {
+			std::this_thread::yield();
+			state = slot.state.load(std::memory_order_acquire);
+		}
+		if (same_string(slot.name, name) && same_string(slot.label, label)) return slot;
+	}
+
+	LOG_RATE_LIMITED(LogLevel::Warn, 60000000, "metrics registry is full, %s is not exported", name);
+	return g_overflow;
+}
+
+Counter& metrics_counter(const char *name, const char *help, const char *label, const char *label_key) {
+	return find_metric(MetricType::Counter, name, help, label, label_key).counter;
+}
+
+Gauge& metrics_gauge(const char *name, const char *help, const char *label, const char *label_key) {
+	return find_metric(MetricType::Gauge, name, help, label, label_key).gauge;
+}
+
+Histogram& metrics_histogram(const char *name, const char *help, const char *label, const char *label_key) {
+	return find_metric(MetricType::Histogram, name, help, label, label_key).histogram;
+}
+
+// time() records every stage of every frame, so each thread keeps the histograms of the stages it recorded
+// instead of searching the registry every time, keyed by the name pointer since stage names are never freed
+static const int STAGE_CACHE_BITS = 6;
+static const usize STAGE_CACHE_SIZE = 1 << STAGE_CACHE_BITS;
+
+struct StageCacheEntry {
+	const char *stage;
+	Histogram *histogram;
+};
+
+static thread_local StageCacheEntry t_stage_cache[STAGE_CACHE_SIZE];
+
+void metrics_record_stage(const char *stage, long elapsed_usec) {
+	// fibonacci hashing spreads the pointers, which are close together and share their low bits
+	usize start = (reinterpret_cast<uintptr_t>(stage) * 0x9e3779b97f4a7c15ull) >> (64 - STAGE_CACHE_BITS);
+	for (usize i = 0; i < STAGE_CACHE_SIZE; i ++) {
+		auto& entry = t_stage_cache[(start + i) % STAGE_CACHE_SIZE];
+		if (entry.stage == nullptr) {
+			entry.histogram = &metrics_histogram("vision_stage_usec", STAGE_HELP, stage);
+			entry.stage = stage;
+		}
+		if (entry.stage == stage) {
+			entry.histogram->record(elapsed_usec);
+			return;
+		}
+	}
+
+	// more stages than the cache holds, the rest are looked up every time
+	metrics_histogram("vision_stage_usec", STAGE_HELP, stage).record(elapsed_usec);
+}
+
+void Histogram::record(long value) {
+	usize index = 0;
+	while (index < BUCKETS && value > BOUNDS[index]) index ++;
+
+	m_buckets[index].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+long Histogram::quantile(double q) const {
+	u64 total = count();
+	if (total == 0) return 0;
+
+	u64 target = std::max<u64>(ceil(q * total), 1);
+	u64 seen = 0;
+	for (usize i = 0; i < BUCKETS; i ++) {
+		seen += bucket(i);
+		if (seen >= target) return BOUNDS[i];
+	}
+	return BOUNDS[BUCKETS - 1];
+}
+
+static const char *type_name(MetricType type) {
+	switch (type) {
+		case MetricType::Counter: return "counter";
+		case MetricType::Gauge: return "gauge";
+		case MetricType::Histogram: return "histogram";
+	}
+	return "untyped";
+}
+
+static void append_format(std::string& out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void append_format(std::string& out, const char *fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	out.append(buf, std::min<usize>(std::max(len, 0), sizeof(buf) - 1));
+}
+
+// escapes backslashes, quotes and newlines, which is enough for both prometheus label values and json strings
+static std::string escape(const char *str) {
+	std::string out;
+	for (; *str != '\0'; str ++) {
+		if (*str == '\\' || *str == '"') {
+			out += '\\';
+			out += *str;
+		} else if (*str == '\n') {
+			out += "\\n";
+		} else {
+			out += *str;
+		}
+	}
+	return out;
+}
+
+// labels for a sample line, extra is another label already formatted, like le="10"
+static std::string prometheus_labels(const MetricSlot& slot, const std::string& extra = {}) {
+	std::string out;
+	if (slot.label != nullptr) out = std::string(slot.label_key) + "=\"" + escape(slot.label) + "\"";
+	if (!extra.empty()) out += (out.empty() ? "" : ",") + extra;
+	return out.empty() ? out : "{" + out + "}";
+}
+
+static usize ready_metrics() {
+	usize count = 0;
+	while (count < MAX_METRICS && g_metrics[count].state.load(std::memory_order_acquire) == SLOT_READY) count ++;
+	return count;
+}
+
+std::string metrics_format_prometheus() {
+	std::string out;
+	usize count = ready_metrics();
+
+	for (usize i = 0; i < count; i ++) {
+		// all samples of a metric family go under a single help and type line
+		bool seen = false;
+		for (usize j = 0; j < i && !seen; j ++) {
+			seen = same_string(g_metrics[j].name, g_metrics[i].name);
+		}
+		if (seen) continue;
+
+		append_format(out, "# HELP %s %s\n", g_metrics[i].name, g_metrics[i].help);
+		append_format(out, "# TYPE %s %s\n", g_metrics[i].name, type_name(g_metrics[i].type));
+
+		for (usize j = i; j < count; j ++) {
+			const auto& slot = g_metrics[j];
+			if (!same_string(slot.name, g_metrics[i].name)) continue;
+
+			switch (slot.type) {
+				case MetricType::Counter:
+					append_format(out, "%s%s %llu\n", slot.name, prometheus_labels(slot).c_str(), (unsigned long long) slot.counter.value());
+					break;
+				case MetricType::Gauge:
+					append_format(out, "%s%s %.6g\n", slot.name, prometheus_labels(slot).c_str(), slot.gauge.value());
+					break;
+				case MetricType::Histogram: {
+					const auto& histogram = slot.histogram;
+					u64 cumulative = 0;
+					for (usize k = 0; k < Histogram::BUCKETS; k ++) {
+						cumulative += histogram.bucket(k);
+						auto le = "le=\"" + std::to_string(Histogram::BOUNDS[k]) + "\"";
+						append_format(out, "%s_bucket%s %llu\n", slot.name, prometheus_labels(slot, le).c_str(), (unsigned long long) cumulative);
+					}
+					cumulative += histogram.bucket(Histogram::BUCKETS);
+					append_format(out, "%s_bucket%s %llu\n", slot.name, prometheus_labels(slot, "le=\"+Inf\"").c_str(), (unsigned long long) cumulative);
+					append_format(out, "%s_sum%s %ld\n", slot.name, prometheus_labels(slot).c_str(), histogram.sum());
+					append_format(out, "%s_count%s %llu\n", slot.name, prometheus_labels(slot).c_str(), (unsigned long long) histogram.count());
+					break;
+				}
+			}
+		}
+	}
+	return out;
+}
+
+std::string metrics_format_json() {
+	std::string out = "{";
+	usize count = ready_metrics();
+
+	for (usize i = 0; i < count; i ++) {
+		const auto& slot = g_metrics[i];
+		// labelled metrics are keyed as name/label
+		std::string key = escape(slot.name);
+		if (slot.label != nullptr) key += "/" + escape(slot.label);
+		append_format(out, "%s\"%s\":", i == 0 ? "" : ",", key.c_str());
+
+		switch (slot.type) {
+			case MetricType::Counter:
+				append_format(out, "%llu", (unsigned long long) slot.counter.value());
+				break;
+			case MetricType::Gauge:
+				append_format(out, "%.6g", slot.gauge.value());
+				break;
+			case MetricType::Histogram:
+				append_format(out, "{\"count\":%llu,\"sum\":%ld,\"p50\":%ld,\"p99\":%ld}",
+					(unsigned long long) slot.histogram.count(), slot.histogram.sum(), slot.histogram.quantile(0.5), slot.histogram.quantile(0.99));
+				break;
+		}
+	}
+	out += "}";
+	return out;
+}
+
+MetricsExporter::~MetricsExporter() {
+	m_stop = true;
+	if (m_thread.joinable()) m_thread.join();
+	delete m_pending.exchange(nullptr);
+}
+
+void MetricsExporter::start(int interval_sec, std::string file_name) {
+	m_interval_sec = interval_sec;
+	m_file_name = std::move(file_name);
+	m_thread = std::thread([this] () {
+		run();
+	});
+}
+
+std::string MetricsExporter::take_payload() {
+	std::unique_ptr<std::string> payload(m_pending.exchange(nullptr, std::memory_order_acq_rel));
+	return payload != nullptr ? std::move(*payload) : std::string {};
+}
+
+void MetricsExporter::run() {
+	set_low_priority();
+
+	static auto& log_dropped_gauge = metrics_gauge("vision_log_records_dropped", "log records dropped because a logging ring buffer was full");
+
+	long next_usec = get_usec() + m_interval_sec * 1000000L;
+	while (!m_stop) {
+		// short sleeps so stopping doesn't wait for a whole interval
+		if (get_usec() < next_usec) {
+			usleep(100000);
+			continue;
+		}
+		next_usec += m_interval_sec * 1000000L;
+
+		log_dropped_gauge.set(log_dropped());
+
+		if (!m_file_name.empty()) {
+			// prometheus' textfile collector may read at any time, so the file is replaced in one rename
+			auto tmp_name = m_file_name + ".tmp";
+			auto text = metrics_format_prometheus();
+			FILE *file = fopen(tmp_name.c_str(), "w");
+			bool ok = file != nullptr && fwrite(text.data(), 1, text.size(), file) == text.size();
+			if (file != nullptr) ok = (fclose(file) == 0) && ok;
+			if (!ok || rename(tmp_name.c_str(), m_file_name.c_str())) {
+				int error = errno;
+				remove(tmp_name.c_str());
+				LOG_RATE_LIMITED(LogLevel::Warn, 60000000, "could not write metrics file, errno %d", error);
+			}
+		}
+
+		delete m_pending.exchange(new std::string(metrics_format_json()), std::memory_order_acq_rel);
+	}
+}
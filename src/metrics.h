@@ -0,0 +1,93 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <string>
+#include <thread>
+
+// process wide registry of counters, gauges and histograms for monitoring
+// updating a metric is a single relaxed atomic operation, so they can be left on in production
+// names and labels must be string literals, since only the pointers are kept
+
+class Counter {
+	public:
+		void add(u64 amount = 1) { m_value.fetch_add(amount, std::memory_order_relaxed); }
+		u64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<u64> m_value { 0 };
+};
+
+class Gauge {
+	public:
+		void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+		double value() const { return m_value.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<double> m_value { 0.0 };
+};
+
+// counts values into fixed buckets, which are spaced for durations in microseconds
+class Histogram {
+	public:
+		// upper bound of each bucket, values above the last bound go into an overflow bucket
+		static constexpr usize BUCKETS = 16;
+		static constexpr long BOUNDS[BUCKETS] = {
+			10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+		};
+
+		void record(long value);
+
+		// consistent enough for monitoring, buckets may be read in the middle of a record
+		u64 bucket(usize index) const { return m_buckets[index].load(std::memory_order_relaxed); }
+		u64 count() const { return m_count.load(std::memory_order_relaxed); }
+		long sum() const { return m_sum.load(std::memory_order_relaxed); }
+		// upper bound of the bucket the given quantile falls into, an estimate that is never too low unless it overflowed
+		long quantile(double q) const;
+
+	private:
+		std::atomic<u64> m_buckets[BUCKETS + 1] {};
+		std::atomic<u64> m_count { 0 };
+		std::atomic<long> m_sum { 0 };
+};
+
+// finds or registers the metric with the given name and label, label_key is the name of the label in prometheus
+// the first call for a metric may briefly wait for another thread registering a metric, later calls never wait,
+// so hot code should keep the returned reference, for example in a static local
+// help is only used the first time a metric is registered
+Counter& metrics_counter(const char *name, const char *help, const char *label = nullptr, const char *label_key = "stage");
+Gauge& metrics_gauge(const char *name, const char *help, const char *label = nullptr, const char *label_key = "stage");
+Histogram& metrics_histogram(const char *name, const char *help, const char *label = nullptr, const char *label_key = "stage");
+
+// records the duration of a processing stage, called by time() for every timed stage
+void metrics_record_stage(const char *stage, long elapsed_usec);
+
+// all metrics in the prometheus text exposition format
+std::string metrics_format_prometheus();
+// all metrics as a single json object, keyed by name or name/label, histograms are summarized as count, sum, p50 and p99
+std::string metrics_format_json();
+
+// periodically writes the metrics to a prometheus text file and prepares a json payload for mqtt
+class MetricsExporter {
+	public:
+		MetricsExporter() = default;
+		~MetricsExporter();
+
+		// file_name may be empty to only prepare mqtt payloads
+		void start(int interval_sec, std::string file_name);
+
+		// returns the payload prepared since the last call, or an empty string if there is none
+		// never blocks, so it can be called on the publishing thread
+		std::string take_payload();
+
+	private:
+		void run();
+
+		int m_interval_sec { 0 };
+		std::string m_file_name;
+
+		std::atomic<bool> m_stop { false };
+		// boxed so handing over a payload is a single pointer exchange
+		std::atomic<std::string *> m_pending { nullptr };
+		std::thread m_thread;
+};
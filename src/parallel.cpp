@@ -1,19 +1,240 @@
 #include "parallel.h"
-#include "stdio.h"
-#include <iostream>
+#include "types.h"
+#include "util.h"
+#include "metrics.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-void parallel_process(cv::Mat in, cv::Mat out, std::function<void(cv::Mat, cv::Mat)> func, int threads) {
-	cv::parallel_for_(cv::Range(0, threads), [&] (const cv::Range& range) {
-		for (int i = range.start; i < range.end; i ++) {
-			int top_row = in.rows * i / threads;
-			// done this way to stop rounding errors causing missed rows
-			int bottom_row = (in.rows * (i + 1) / threads) - top_row;
-			cv::Rect sub_rect(0, top_row, in.cols, bottom_row);
+static const int MAX_WORKERS = 32;
 
-			cv::Mat sub_in(in, sub_rect);
-			cv::Mat sub_out(out, sub_rect);
+static const char *WORKER_LABELS[MAX_WORKERS] = {
+	"0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15",
+	"16", "17", "18", "19", "20", "21", "22", "23", "24", "25", "26", "27", "28", "29", "30", "31",
+};
 
-			func(sub_in, sub_out);
+// a worker's deque of chunks is a contiguous range, packed into one word with the job generation so it can be updated with a single cas
+// the owner takes chunks from the front and thieves take them from the back
+// the generation stops a worker that is still looking for chunks of a finished job from taking chunks of the next one
+static const int RANGE_BITS = 22;
+static const u64 RANGE_MASK = (1ull << RANGE_BITS) - 1;
+static const u64 GENERATION_MASK = (1ull << (64 - 2 * RANGE_BITS)) - 1;
+
+static u64 pack_range(u64 generation, u64 begin, u64 end) {
+	return ((generation & GENERATION_MASK) << (2 * RANGE_BITS)) | (begin << RANGE_BITS) | end;
+}
+
+static u64 range_generation(u64 range) { return range >> (2 * RANGE_BITS); }
+static u64 range_begin(u64 range) { return (range >> RANGE_BITS) & RANGE_MASK; }
+static u64 range_end(u64 range) { return range & RANGE_MASK; }
+
+class StealingPool {
+	public:
+		StealingPool() = default;
+		~StealingPool();
+
+		void run(int chunks, int threads, const std::function<void(int)>& func);
+
+	private:
+		struct alignas(64) Worker {
+			std::atomic<u64> range { 0 };
+		};
+
+		struct WorkerMetrics {
+			Counter *chunks;
+			Counter *busy_usec;
+		};
+
+		void grow(int workers);
+		void worker_thread(int index);
+		// runs chunks of the current job until there are none left to take or steal
+		// stage is what the chunks count towards in hardware counters, nullptr on the calling thread which already counts them
+		void work(int index, u64 generation, const std::function<void(int)>& func, int participants, const char *stage);
+		bool pop(int index, u64 generation, int& chunk);
+		bool steal(int index, u64 generation, int participants);
+
+		Worker m_workers[MAX_WORKERS];
+		WorkerMetrics m_metrics[MAX_WORKERS] {};
+		std::vector<std::thread> m_threads;
+
+		std::mutex m_lock;
+		std::condition_variable m_wake;
+		bool m_stop { false };
+		// the current job, only read under m_lock when a worker wakes up
+		u64 m_generation { 0 };
+		const std::function<void(int)> *m_func { nullptr };
+		int m_participants { 0 };
+		const char *m_stage { nullptr };
+
+		std::atomic<int> m_remaining { 0 };
+};
+
+StealingPool::~StealingPool() {
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (auto& thread : m_threads) {
+		thread.join();
+	}
+}
+
+static std::function<void()> g_worker_start;
+
+void parallel_set_worker_start(std::function<void()> func) {
+	g_worker_start = std::move(func);
+}
+
+void StealingPool::grow(int workers) {
+	// worker 0 is the thread calling run, the others are started here and inherit its scheduling and affinity unless the start hook changes them
+	for (int i = m_threads.size() + 1; i < workers; i ++) {
+		m_threads.emplace_back([this, i] () {
+			trace_thread_name("worker");
+			if (g_worker_start) g_worker_start();
+			worker_thread(i);
+		});
+	}
+	for (int i = 0; i < workers; i ++) {
+		if (m_metrics[i].chunks != nullptr) continue;
+		m_metrics[i].chunks = &metrics_counter("vision_worker_chunks_total", "parallel chunks run by each worker, including stolen ones", WORKER_LABELS[i], "worker");
+		m_metrics[i].busy_usec = &metrics_counter("vision_worker_busy_usec_total", "time each worker spent running parallel chunks", WORKER_LABELS[i], "worker");
+	}
+}
+
+void StealingPool::run(int chunks, int threads, const std::function<void(int)>& func) {
+	int participants = std::min({ threads, chunks, MAX_WORKERS });
+	grow(participants);
+
+	u64 generation;
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		generation = ++ m_generation;
+		m_func = &func;
+		m_participants = participants;
+		m_stage = perf_counters_stage();
+		m_remaining.store(chunks, std::memory_order_relaxed);
+
+		for (int i = 0; i < MAX_WORKERS; i ++) {
+			u64 begin = i < participants ? (u64) chunks * i / participants : 0;
+			u64 end = i < participants ? (u64) chunks * (i + 1) / participants : 0;
+			m_workers[i].range.store(pack_range(generation, begin, end));
 		}
-	});
+	}
+	m_wake.notify_all();
+
+	work(0, generation, func, participants, nullptr);
+
+	// the last chunks may still be running on other workers
+	while (m_remaining.load(std::memory_order_acquire) > 0) {
+		std::this_thread::yield();
+	}
+}
+
+void StealingPool::worker_thread(int index) {
+	u64 seen_generation = 0;
+	for (;;) {
+		u64 generation;
+		const std::function<void(int)> *func;
+		int participants;
+		const char *stage;
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_wake.wait(lock, [&] () {
+				return m_stop || m_generation != seen_generation;
+			});
+			if (m_stop) return;
+
+			generation = seen_generation = m_generation;
+			func = m_func;
+			participants = m_participants;
+			stage = m_stage;
+		}
+
+		// a worker woken late may find the job already finished, then every cas fails and it goes back to sleep
+		if (index < participants) {
+			work(index, generation, *func, participants, stage);
+		}
+	}
+}
+
+bool StealingPool::pop(int index, u64 generation, int& chunk) {
+	auto& range = m_workers[index].range;
+	u64 current = range.load();
+	for (;;) {
+		if ((range_generation(current) != (generation & GENERATION_MASK)) || range_begin(current) >= range_end(current)) return false;
+		if (range.compare_exchange_weak(current, pack_range(generation, range_begin(current) + 1, range_end(current)))) {
+			chunk = range_begin(current);
+			return true;
+		}
+	}
+}
+
+bool StealingPool::steal(int index, u64 generation, int participants) {
+	static auto& stolen = metrics_counter("vision_chunks_stolen_total", "parallel chunks moved to an idle worker by work stealing");
+
+	for (int offset = 1; offset < participants; offset ++) {
+		auto& victim = m_workers[(index + offset) % participants].range;
+		u64 current = victim.load();
+		for (;;) {
+			u64 begin = range_begin(current);
+			u64 end = range_end(current);
+			if (range_generation(current) != (generation & GENERATION_MASK) || begin >= end) break;
+
+			// taking half leaves the victim its nearest chunks and keeps the amount of steals logarithmic
+			u64 take = (end - begin + 1) / 2;
+			if (victim.compare_exchange_weak(current, pack_range(generation, begin, end - take))) {
+				// our own deque is empty and nobody steals from an empty deque, so a plain store is enough
+				m_workers[index].range.store(pack_range(generation, end - take, end));
+				stolen.add(take);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void StealingPool::work(int index, u64 generation, const std::function<void(int)>& func, int participants, const char *stage) {
+	auto& metrics = m_metrics[index];
+	int chunk;
+	for (;;) {
+		while (pop(index, generation, chunk)) {
+			long start_usec = get_usec();
+			{
+				PerfStage perf_stage(stage, false);
+				func(chunk);
+			}
+			metrics.busy_usec->add(get_usec() - start_usec);
+			metrics.chunks->add();
+			m_remaining.fetch_sub(1, std::memory_order_release);
+		}
+		if (!steal(index, generation, participants)) return;
+	}
+}
+
+void parallel_for(int count, int grain, int threads, std::function<void(int, int)> func) {
+	if (count <= 0) return;
+	// chunk indices have to fit in a packed range
+	grain = std::max<int>(grain, (count + RANGE_MASK - 1) / RANGE_MASK);
+	int chunks = (count + grain - 1) / grain;
+
+	if (threads <= 1 || chunks == 1) {
+		func(0, count);
+		return;
+	}
+
+	// each thread gets its own workers, so frames processed concurrently by a pipeline don't queue behind each other
+	thread_local std::unique_ptr<StealingPool> pool;
+	if (pool == nullptr) pool = std::make_unique<StealingPool>();
+
+	std::function<void(int)> run_chunk = [&] (int chunk) {
+		func(chunk * grain, std::min((chunk + 1) * grain, count));
+	};
+	pool->run(chunks, threads, run_chunk);
 }
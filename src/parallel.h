@@ -1,4 +1,14 @@
-#include <opencv2/opencv.hpp>
+#pragma once
+
 #include <functional>
 
-void parallel_process(cv::Mat in, cv::Mat out, std::function<void(cv::Mat, cv::Mat)> func, int threads);
+// runs func over [0, count) in chunks of grain items, on up to threads threads including the calling thread
+// each worker starts on its own contiguous share of the chunks and steals half of another worker's remaining chunks when it runs out,
+// so a slow or preempted core only delays the chunk it is running instead of a whole share
+// the workers belong to the calling thread, so concurrent callers never wait for each other
+void parallel_for(int count, int grain, int threads, std::function<void(int, int)> func);
+
+// called at the start of every worker thread, before it runs any chunks, to give workers their own scheduling and affinity
+// workers otherwise inherit them from the thread that started them, so it has to be set before the first parallel_for
+void parallel_set_worker_start(std::function<void()> func);
+
@@ -0,0 +1,184 @@
+#include "perf_counters.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace perf_detail {
+	std::atomic<bool> g_enabled { false };
+}
+
+namespace {
+	const int EVENTS = 4;
+	const u64 EVENT_CONFIGS[EVENTS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+
+	// the counters of one thread, read together as a group so they cover exactly the same instructions
+	struct ThreadCounters {
+		bool opened { false };
+		int leader_fd { -1 };
+		int fds[EVENTS] { -1, -1, -1, -1 };
+		// position of each event in a group read, or -1 if it couldn't be opened on this cpu
+		int slot[EVENTS] { -1, -1, -1, -1 };
+		int count { 0 };
+
+		~ThreadCounters() {
+			for (int fd : fds) {
+				if (fd >= 0) close(fd);
+			}
+		}
+	};
+
+	struct alignas(64) StageTotals {
+		std::atomic<const char *> name { nullptr };
+		std::atomic<u64> samples { 0 };
+		std::atomic<u64> values[EVENTS] {};
+	};
+
+	const usize MAX_STAGES = 64;
+	StageTotals g_stages[MAX_STAGES];
+	std::atomic<u64> g_pixels { 0 };
+	std::atomic<u64> g_threads_failed { 0 };
+
+	thread_local ThreadCounters t_counters;
+	thread_local const char *t_stage = nullptr;
+
+	int open_event(u64 config, int group_fd) {
+		perf_event_attr attr {};
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		// user space only, which is all perf_event_paranoid 2 allows, and all stages run in anyway
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	// opens the calling thread's counters on first use, returns false if it has none
+	bool open_thread_counters(int *err = nullptr) {
+		auto& counters = t_counters;
+		if (counters.opened) return counters.leader_fd >= 0;
+		counters.opened = true;
+
+		for (int i = 0; i < EVENTS; i ++) {
+			int fd = open_event(EVENT_CONFIGS[i], counters.leader_fd);
+			if (fd < 0) {
+				if (i == 0) {
+					if (err != nullptr) *err = errno;
+					g_threads_failed.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+				// some cpus, and most virtual machines, lack some events, the rest are still useful
+				continue;
+			}
+			if (i == 0) counters.leader_fd = fd;
+			counters.fds[i] = fd;
+			counters.slot[i] = counters.count ++;
+		}
+		return true;
+	}
+
+	bool read_thread_counters(u64 *values) {
+		auto& counters = t_counters;
+		u64 buf[1 + EVENTS];
+		ssize_t len = read(counters.leader_fd, buf, sizeof(buf));
+		if (len < (ssize_t) sizeof(u64) || buf[0] != (u64) counters.count) return false;
+
+		for (int i = 0; i < EVENTS; i ++) {
+			values[i] = counters.slot[i] >= 0 ? buf[1 + counters.slot[i]] : 0;
+		}
+		return true;
+	}
+
+	StageTotals *find_stage(const char *name) {
+		for (auto& stage : g_stages) {
+			const char *current = stage.name.load(std::memory_order_acquire);
+			if (current == nullptr && stage.name.compare_exchange_strong(current, name, std::memory_order_acq_rel)) {
+				return &stage;
+			}
+			if (current == name || strcmp(current, name) == 0) return &stage;
+		}
+		return nullptr;
+	}
+}
+
+bool perf_counters_start(std::string& error) {
+	int err = 0;
+	if (!open_thread_counters(&err)) {
+		error = strerror(err);
+		if (err == EACCES || err == EPERM) {
+			error += ", kernel.perf_event_paranoid may need to be 2 or lower, or the process needs CAP_PERFMON";
+		} else if (err == ENOENT || err == EOPNOTSUPP || err == ENODEV) {
+			error += ", this cpu or virtual machine has no hardware counters";
+		}
+		return false;
+	}
+
+	perf_detail::g_enabled.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+void perf_counters_add_pixels(u64 pixels) {
+	if (perf_counters_enabled()) g_pixels.fetch_add(pixels, std::memory_order_relaxed);
+}
+
+const char *perf_counters_stage() {
+	return t_stage;
+}
+
+void PerfStage::begin() {
+	m_outer_stage = t_stage;
+	t_stage = m_stage;
+	m_valid = open_thread_counters() && read_thread_counters(m_begin);
+}
+
+void PerfStage::end() {
+	t_stage = m_outer_stage;
+
+	u64 values[EVENTS];
+	if (!m_valid || !read_thread_counters(values)) return;
+
+	auto stage = find_stage(m_stage);
+	if (stage == nullptr) return;
+	if (m_sample) stage->samples.fetch_add(1, std::memory_order_relaxed);
+	for (int i = 0; i < EVENTS; i ++) {
+		stage->values[i].fetch_add(values[i] - m_begin[i], std::memory_order_relaxed);
+	}
+}
+
+void perf_counters_report() {
+	if (!perf_counters_enabled()) return;
+
+	u64 pixels = g_pixels.load(std::memory_order_relaxed);
+	printf("hardware counters per stage, including time in nested stages and parallel workers:\n");
+	printf("%-20s %10s %14s %14s %6s %14s %14s %10s %10s\n", "stage", "samples", "cycles", "instructions", "ipc", "cache misses", "branch misses", "cm/pixel", "bm/pixel");
+	for (const auto& stage : g_stages) {
+		const char *name = stage.name.load(std::memory_order_acquire);
+		if (name == nullptr) break;
+
+		u64 cycles = stage.values[0].load(std::memory_order_relaxed);
+		u64 instructions = stage.values[1].load(std::memory_order_relaxed);
+		u64 cache_misses = stage.values[2].load(std::memory_order_relaxed);
+		u64 branch_misses = stage.values[3].load(std::memory_order_relaxed);
+		printf("%-20s %10llu %14llu %14llu %6.2f %14llu %14llu %10.4f %10.4f\n", name,
+			(unsigned long long) stage.samples.load(std::memory_order_relaxed),
+			(unsigned long long) cycles, (unsigned long long) instructions,
+			cycles > 0 ? (double) instructions / cycles : 0.0,
+			(unsigned long long) cache_misses, (unsigned long long) branch_misses,
+			pixels > 0 ? (double) cache_misses / pixels : 0.0,
+			pixels > 0 ? (double) branch_misses / pixels : 0.0);
+	}
+
+	u64 failed = g_threads_failed.load(std::memory_order_relaxed);
+	if (failed > 0) {
+		printf("warning: %llu threads could not open hardware counters, their work is missing from the totals\n", (unsigned long long) failed);
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <string>
+
+// hardware performance counters from perf_event_open, totalled per processing stage
+// every timed stage counts cycles, instructions, cache misses and branch misses on the thread running it,
+// and parallel workers count towards the stage of the thread that handed them work
+// each thread opens its own counters the first time it runs a stage, a thread that can't open them is simply not counted
+// stage names must be string literals, only the pointers are stored
+
+namespace perf_detail {
+	extern std::atomic<bool> g_enabled;
+}
+
+inline bool perf_counters_enabled() {
+	return perf_detail::g_enabled.load(std::memory_order_relaxed);
+}
+
+// opens counters on the calling thread to check they are available, and starts counting if they are
+// returns false and leaves counting off if perf events are missing or restricted, error then says why
+bool perf_counters_start(std::string& error);
+
+// counts the pixels of a processed frame, so misses can be reported per pixel
+void perf_counters_add_pixels(u64 pixels);
+
+// prints the totals of every stage, with instructions per cycle and misses per pixel
+void perf_counters_report();
+
+// stage the calling thread is counting towards, nullptr outside of stages
+const char *perf_counters_stage();
+
+// counts hardware events from construction to destruction towards stage, which is the thread's current stage meanwhile
+// does nothing if stage is nullptr or counting is off
+// sample is false for the chunks workers run on a stage's behalf, so a stage's samples are the times it ran rather than its chunks
+class PerfStage {
+	public:
+		explicit PerfStage(const char *stage, bool sample = true)
+		: m_stage(perf_counters_enabled() ? stage : nullptr)
+		, m_sample(sample)
+		{
+			if (m_stage != nullptr) begin();
+		}
+
+		~PerfStage() {
+			if (m_stage != nullptr) end();
+		}
+
+		PerfStage(const PerfStage&) = delete;
+		PerfStage& operator=(const PerfStage&) = delete;
+
+	private:
+		static const int EVENTS = 4;
+
+		void begin();
+		void end();
+
+		const char *m_stage;
+		bool m_sample;
+		const char *m_outer_stage { nullptr };
+		bool m_valid { false };
+		u64 m_begin[EVENTS] {};
+};
@@ -0,0 +1,55 @@
+#!/bin/sh
+# builds Vision as a plain release build and as a profile guided, link time optimized build,
+# then benchmarks both on the same synthesized frames
+#
+# usage: ./pgo.sh [template image]
+# BENCH_ARGS and TRAIN_ARGS can be set to change the frames used for benchmarking and training
+set -e
+
+src_dir=$(cd "$(dirname "$0")" && pwd)
+template=${1:-$src_dir/../yellowBall2xTemplate.jpg}
+jobs=$(nproc)
+release_dir=$src_dir/build-release
+pgo_dir=$src_dir/build-pgo
+profile_dir=$pgo_dir/pgo-data
+
+train_args=${TRAIN_ARGS:-"--frames 3000 --distractors 100"}
+bench_args=${BENCH_ARGS:-"--frames 5000 --distractors 100"}
+
+# configures and builds in the directory given first, passing the rest to cmake
+# written for cmake 3.9, which has no -S, -B or --build -j
+build() {
+	dir=$1
+	shift
+	mkdir -p "$dir"
+	(cd "$dir" && cmake "$src_dir" "$@")
+	cmake --build "$dir" -- -j"$jobs"
+}
+
+echo "== building plain release"
+build "$release_dir" -DCMAKE_BUILD_TYPE=Release -DVISION_LTO=OFF -DVISION_PGO=off
+
+echo "== building instrumented binary"
+rm -rf "$profile_dir"
+build "$pgo_dir" -DCMAKE_BUILD_TYPE=Release -DVISION_LTO=ON -DVISION_PGO=generate -DVISION_PGO_DIR="$profile_dir"
+
+echo "== training"
+# a few resolutions and thread counts, so the profile doesn't only describe one configuration
+for size in "--width 320 --height 240" "--width 640 --height 480"; do
+	for threads in 1 4; do
+		"$pgo_dir/vision_train" $train_args $size --threads $threads "$template"
+	done
+done
+
+if command -v llvm-profdata > /dev/null && ls "$profile_dir"/*.profraw > /dev/null 2>&1; then
+	llvm-profdata merge -output="$profile_dir/default.profdata" "$profile_dir"/*.profraw
+fi
+
+echo "== building with profile"
+# the same build directory is reused, since gcc names profiles after the object file paths
+build "$pgo_dir" -DVISION_PGO=use
+
+echo "== benchmark: plain release"
+"$release_dir/vision_train" $bench_args "$template"
+echo "== benchmark: lto + pgo"
+"$pgo_dir/vision_train" $bench_args "$template"
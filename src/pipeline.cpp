@@ -0,0 +1,89 @@
+#include "pipeline.h"
+#include "util.h"
+
+FramePipeline::FramePipeline(const Vision& vision, int depth, bool capture_debug, std::function<void(VisionContext&)> on_worker_start)
+: m_vision(vision)
+, m_depth(depth)
+, m_capture_debug(capture_debug)
+, m_on_worker_start(std::move(on_worker_start))
+{
+	for (int i = 0; i < depth; i ++) {
+		m_workers.emplace_back([this] () { worker(); });
+	}
+}
+
+FramePipeline::~FramePipeline() {
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+
+	for (auto& thread : m_workers) {
+		thread.join();
+	}
+}
+
+void FramePipeline::submit(Frame frame) {
+	bool capture_debug = m_capture_debug.load(std::memory_order_relaxed);
+	std::packaged_task<FrameResult(VisionContext&)> job([this, frame = std::move(frame), capture_debug] (VisionContext& ctx) {
+		FrameResult result;
+		ctx.capture_debug = capture_debug;
+		ctx.scale = frame.scale;
+		ctx.offset = frame.offset;
+		result.capture_usec = frame.capture_usec;
+		result.has_truth = frame.has_truth;
+		result.truth = frame.truth;
+		result.target = time<std::optional<Target>>("frame", [&] () {
+			return m_vision.process(frame.image, ctx);
+		}, &result.elapsed_usec);
+		result.debug = std::move(ctx.debug);
+		if (result.debug != nullptr) result.debug->lease = frame.lease;
+		result.class_targets = ctx.class_targets;
+		return result;
+	});
+	m_results.push_back(job.get_future());
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_jobs.push_back(std::move(job));
+	}
+	m_cond.notify_one();
+}
+
+FrameResult FramePipeline::next() {
+	auto result = m_results.front().get();
+	m_results.pop_front();
+	return result;
+}
+
+void FramePipeline::set_capture_debug(bool capture_debug) {
+	m_capture_debug.store(capture_debug, std::memory_order_relaxed);
+}
+
+usize FramePipeline::in_flight() const {
+	return m_results.size();
+}
+
+bool FramePipeline::full() const {
+	return m_results.size() >= m_depth;
+}
+
+void FramePipeline::worker() {
+	// each worker keeps its own scratch buffers so they are reused across frames
+	VisionContext ctx;
+	if (m_on_worker_start) m_on_worker_start(ctx);
+
+	for (;;) {
+		std::packaged_task<FrameResult(VisionContext&)> job;
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_cond.wait(guard, [this] () { return m_stop || !m_jobs.empty(); });
+			if (m_jobs.empty()) return;
+
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+		job(ctx);
+	}
+}
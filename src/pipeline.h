@@ -0,0 +1,70 @@
+#pragma once
+
+#include "types.h"
+#include "vision.h"
+#include "frame.h"
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// result of processing a single frame
+struct FrameResult {
+	std::optional<Target> target;
+	// targets of the extra colour classes, see VisionContext
+	std::vector<std::optional<Target>> class_targets;
+	// time spent in Vision::process
+	long elapsed_usec;
+	// when the frame was captured, in microseconds since the unix epoch
+	long capture_usec;
+	// only set if debug snapshots were requested
+	std::shared_ptr<DebugSnapshot> debug;
+	// ground truth of the frame, see Frame
+	bool has_truth { false };
+	cv::Rect truth;
+};
+
+// processes up to depth frames concurrently on separate threads
+// results are returned by next in the same order the frames were submitted
+class FramePipeline {
+	public:
+		// on_worker_start is called on each worker thread before it processes any frames, with that worker's context
+		FramePipeline(const Vision& vision, int depth, bool capture_debug = false, std::function<void(VisionContext&)> on_worker_start = {});
+		~FramePipeline();
+
+		// the frame and its lease are kept until its result has been returned by next
+		void submit(Frame frame);
+		// blocks until the oldest submitted frame has finished processing
+		FrameResult next();
+
+		// applies to frames submitted after this call
+		void set_capture_debug(bool capture_debug);
+
+		usize in_flight() const;
+		bool full() const;
+
+	private:
+		void worker();
+
+		const Vision& m_vision;
+		usize m_depth;
+		std::atomic<bool> m_capture_debug;
+		std::function<void(VisionContext&)> m_on_worker_start;
+
+		std::vector<std::thread> m_workers;
+
+		std::mutex m_lock;
+		std::condition_variable m_cond;
+		bool m_stop { false };
+		std::deque<std::packaged_task<FrameResult(VisionContext&)>> m_jobs;
+
+		// only accessed by the submitting thread
+		std::deque<std::future<FrameResult>> m_results;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// holds an immutable value that readers use without locking while a writer replaces it
+// readers only touch two atomic counters, the writer waits until no reader can still see the old value before freeing it
+// the wait uses two reader counters selected by the parity of an epoch, so a steady stream of new readers can't starve it
+template<typename T>
+class RcuCell {
+	public:
+		// keeps the value it was created from alive until it is destroyed, it must not outlive the cell
+		class ReadGuard {
+			public:
+				ReadGuard(const ReadGuard&) = delete;
+				ReadGuard& operator=(const ReadGuard&) = delete;
+
+				~ReadGuard() {
+					m_cell.m_readers[m_index].count.fetch_sub(1, std::memory_order_release);
+				}
+
+				const T& operator*() const { return *m_value; }
+				const T *operator->() const { return m_value; }
+
+			private:
+				friend class RcuCell;
+
+				explicit ReadGuard(const RcuCell& cell)
+				: m_cell(cell)
+				{
+					// the counter is raised before the value is loaded, so a writer that swapped the value
+					// afterwards is guaranteed to see this reader when it waits
+					m_index = m_cell.m_epoch.load() & 1;
+					m_cell.m_readers[m_index].count.fetch_add(1);
+					m_value = m_cell.m_value.load();
+				}
+
+				const RcuCell& m_cell;
+				u64 m_index;
+				const T *m_value;
+		};
+
+		explicit RcuCell(std::unique_ptr<const T> value)
+		: m_value(value.release())
+		{
+		}
+
+		~RcuCell() {
+			delete m_value.load();
+		}
+
+		RcuCell(const RcuCell&) = delete;
+		RcuCell& operator=(const RcuCell&) = delete;
+
+		ReadGuard read() const {
+			return ReadGuard(*this);
+		}
+
+		// swaps in the new value, then blocks until every reader that could have seen the old value is done
+		// it must not be called while the calling thread holds a read guard on this cell
+		void publish(std::unique_ptr<const T> value) {
+			std::lock_guard<std::mutex> lock(m_write_mutex);
+			const T *old = m_value.exchange(value.release());
+
+			// a reader may load the epoch just before a flip and only raise its counter after it,
+			// so both counters have to drain once, each after the epoch moved away from it
+			for (int i = 0; i < 2; i ++) {
+				u64 index = m_epoch.fetch_add(1) & 1;
+				while (m_readers[index].count.load() != 0) {
+					std::this_thread::yield();
+				}
+			}
+
+			delete old;
+		}
+
+	private:
+		// each counter gets its own cache line, since readers on different cores hit them every frame
+		struct alignas(64) ReaderCount {
+			std::atomic<long> count { 0 };
+		};
+
+		std::atomic<const T *> m_value;
+		mutable std::atomic<u64> m_epoch { 0 };
+		mutable ReaderCount m_readers[2];
+		std::mutex m_write_mutex;
+};
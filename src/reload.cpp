@@ -0,0 +1,327 @@
+#include "reload.h"
+#include "template_cache.h"
+#include "util.h"
+#include "log.h"
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+static std::string trim(const std::string& str) {
+	auto start = str.find_first_not_of(" \t\r\n");
+	if (start == std::string::npos) return {};
+	auto end = str.find_last_not_of(" \t\r\n");
+	return str.substr(start, end - start + 1);
+}
+
+static std::optional<cv::Scalar> parse_hsv(const std::string& str) {
+	std::istringstream stream(str);
+	cv::Scalar out;
+	for (int i = 0; i < 3; i ++) {
+		if (!(stream >> out[i]) || out[i] < 0 || out[i] > 255) return {};
+	}
+
+	std::string rest;
+	if (stream >> rest) return {};
+	return out;
+}
+
+std::optional<ColourClass> parse_colour_class(const std::string& str) {
+	std::string values = str;
+	std::replace(values.begin(), values.end(), ',', ' ');
+	std::istringstream stream(values);
+	ColourClass out;
+	for (int i = 0; i < 6; i ++) {
+		double& value = i < 3 ? out.thresh_min[i] : out.thresh_max[i - 3];
+		if (!(stream >> value) || value < 0 || value > 255) return {};
+	}
+
+	std::string rest;
+	if (stream >> rest) return {};
+	return out;
+}
+
+std::optional<Extractor> parse_extractor(const std::string& str) {
+	if (str == "contours") return Extractor::Contours;
+	if (str == "blobs") return Extractor::Blobs;
+	return {};
+}
+
+std::optional<Detector> parse_detector(const std::string& str) {
+	if (str == "template") return Detector::Template;
+	if (str == "ball") return Detector::Ball;
+	return {};
+}
+
+std::optional<VisionConfig> parse_vision_config(const std::string& text, std::string& error) {
+	VisionConfig out;
+	std::istringstream stream(text);
+	std::string line;
+	int line_number = 0;
+	while (std::getline(stream, line)) {
+		line_number ++;
+		line = trim(line);
+		if (line.empty() || line[0] == '#') continue;
+
+		auto equals = line.find('=');
+		if (equals == std::string::npos) {
+			error = "line " + std::to_string(line_number) + ": expected key = value";
+			return {};
+		}
+
+		auto key = trim(line.substr(0, equals));
+		auto value = trim(line.substr(equals + 1));
+		if (key == "thresh_min" || key == "thresh_max") {
+			auto hsv = parse_hsv(value);
+			if (!hsv.has_value()) {
+				error = "line " + std::to_string(line_number) + ": " + key + " needs three values from 0 to 255";
+				return {};
+			}
+			(key == "thresh_min" ? out.thresh_min : out.thresh_max) = hsv;
+		} else if (key == "morph_size") {
+			char *end = nullptr;
+			long morph_size = strtol(value.c_str(), &end, 10);
+			if (value.empty() || *end != '\0' || morph_size < 1 || morph_size > 31 || morph_size % 2 == 0) {
+				error = "line " + std::to_string(line_number) + ": morph_size must be an odd number from 1 to 31";
+				return {};
+			}
+			out.morph_size = morph_size;
+		} else if (key == "max_match") {
+			char *end = nullptr;
+			double max_match = strtod(value.c_str(), &end);
+			if (value.empty() || *end != '\0' || !(max_match > 0)) {
+				error = "line " + std::to_string(line_number) + ": max_match must be a positive number";
+				return {};
+			}
+			out.max_match = max_match;
+		} else if (key == "extractor") {
+			out.extractor = parse_extractor(value);
+			if (!out.extractor.has_value()) {
+				error = "line " + std::to_string(line_number) + ": extractor must be contours or blobs";
+				return {};
+			}
+		} else if (key == "detector") {
+			out.detector = parse_detector(value);
+			if (!out.detector.has_value()) {
+				error = "line " + std::to_string(line_number) + ": detector must be template or ball";
+				return {};
+			}
+		} else if (key == "class") {
+			auto colour_class = parse_colour_class(value);
+			if (!colour_class.has_value()) {
+				error = "line " + std::to_string(line_number) + ": class needs six values from 0 to 255";
+				return {};
+			}
+			if (!out.classes.has_value()) out.classes.emplace();
+			if (out.classes->size() + 1 >= MAX_COLOUR_CLASSES) {
+				error = "line " + std::to_string(line_number) + ": at most " + std::to_string(MAX_COLOUR_CLASSES - 1) + " classes besides the target colour";
+				return {};
+			}
+			out.classes->push_back(*colour_class);
+		} else if (key == "template") {
+			if (value.empty()) {
+				error = "line " + std::to_string(line_number) + ": template needs a file name";
+				return {};
+			}
+			out.template_file = value;
+		} else {
+			error = "line " + std::to_string(line_number) + ": unknown key '" + key + "'";
+			return {};
+		}
+	}
+	return out;
+}
+
+std::optional<VisionConfig> read_vision_config(const std::string& file_name, std::string& error) {
+	std::ifstream file(file_name);
+	if (!file) {
+		error = "could not open '" + file_name + "'";
+		return {};
+	}
+
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	auto out = parse_vision_config(text, error);
+	if (!out.has_value()) error = file_name + ": " + error;
+	return out;
+}
+
+void apply_vision_config(const VisionConfig& config, VisionParams& params) {
+	params.thresh_min = config.thresh_min.value_or(params.thresh_min);
+	params.thresh_max = config.thresh_max.value_or(params.thresh_max);
+	params.morph_size = config.morph_size.value_or(params.morph_size);
+	params.max_match = config.max_match.value_or(params.max_match);
+	params.extractor = config.extractor.value_or(params.extractor);
+	params.detector = config.detector.value_or(params.detector);
+	if (config.classes.has_value()) params.extra_classes = *config.classes;
+}
+
+VisionParams load_vision_params(const std::string& template_file, const std::string& cache_file, VisionParams settings) {
+	std::ifstream template_stream(template_file, std::ios::binary);
+	std::vector<u8> template_bytes((std::istreambuf_iterator<char>(template_stream)), std::istreambuf_iterator<char>());
+	if (template_bytes.empty()) {
+		throw std::runtime_error("template file '" + template_file + "' empty or missing");
+	}
+
+	// the descriptor is keyed by the raw file, so on a hit the image doesn't even need to be decoded
+	const u64 cache_key = template_cache_key(template_bytes, settings.thresh_min, settings.thresh_max, settings.morph_size, (int) settings.extractor);
+	if (!cache_file.empty()) {
+		auto descriptor = load_template_descriptor(cache_file, cache_key);
+		if (descriptor.has_value()) {
+			return make_vision_params(std::move(settings), std::move(descriptor->features));
+		}
+	}
+
+	auto template_img = cv::imdecode(template_bytes, -1);
+	if (template_img.empty()) {
+		throw std::runtime_error("template file '" + template_file + "' is not a valid image");
+	}
+
+	VisionParams out;
+	try {
+		out = make_vision_params(std::move(settings), template_img);
+	} catch (const std::runtime_error& err) {
+		throw std::runtime_error("template file '" + template_file + "': " + err.what());
+	}
+
+	if (!cache_file.empty()) {
+		TemplateDescriptor descriptor { cache_key, out.thresh_min, out.thresh_max, out.tmpl };
+		if (!save_template_descriptor(cache_file, descriptor)) {
+			printf("warning: could not write template descriptor '%s'\n", cache_file.c_str());
+		}
+	}
+	return out;
+}
+
+VisionReloader::VisionReloader(Vision& vision, ReloadSettings settings, std::atomic<bool>& reload_flag)
+: m_vision(vision)
+, m_settings(std::move(settings))
+, m_reload_flag(reload_flag)
+{
+	if (!m_settings.config_file.empty()) {
+		// editors often replace the file instead of writing it, so the directory is watched rather than the file
+		auto slash = m_settings.config_file.rfind('/');
+		auto dir = slash == std::string::npos ? std::string {"."} : m_settings.config_file.substr(0, slash + 1);
+		m_config_name = m_settings.config_file.substr(slash == std::string::npos ? 0 : slash + 1);
+
+		m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (m_inotify_fd < 0 || inotify_add_watch(m_inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			printf("warning: could not watch '%s' for changes, only reload requests apply it\n", m_settings.config_file.c_str());
+			if (m_inotify_fd >= 0) close(m_inotify_fd);
+			m_inotify_fd = -1;
+		}
+	}
+
+	m_thread = std::thread([this] () {
+		run();
+	});
+}
+
+VisionReloader::~VisionReloader() {
+	m_stop = true;
+	if (m_thread.joinable()) m_thread.join();
+	if (m_inotify_fd >= 0) close(m_inotify_fd);
+}
+
+void VisionReloader::submit(std::string config) {
+	std::lock_guard<std::mutex> guard(m_submitted_lock);
+	m_submitted.push_back(std::move(config));
+}
+
+void VisionReloader::run() {
+	// building new parameters decodes images and finds contours, which must not take time from processing
+	set_low_priority();
+
+	std::vector<std::string> submitted;
+	while (!m_stop) {
+		bool changed = config_changed();
+		if (m_reload_flag.exchange(false) || changed) {
+			reload();
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_submitted_lock);
+			submitted.swap(m_submitted);
+		}
+		for (const auto& text : submitted) {
+			if (trim(text) == "reload") {
+				reload();
+				continue;
+			}
+
+			std::string error;
+			auto config = parse_vision_config(text, error);
+			if (!config.has_value()) {
+				printf("warning: ignoring submitted config: %s\n", error.c_str());
+				continue;
+			}
+			apply(*config);
+		}
+		submitted.clear();
+	}
+}
+
+bool VisionReloader::config_changed() {
+	if (m_inotify_fd < 0) {
+		usleep(POLL_MSEC * 1000);
+		return false;
+	}
+
+	pollfd poll_fd { m_inotify_fd, POLLIN, 0 };
+	if (poll(&poll_fd, 1, POLL_MSEC) <= 0) return false;
+
+	bool changed = false;
+	alignas(inotify_event) char buf[4096];
+	ssize_t len;
+	while ((len = read(m_inotify_fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t offset = 0; offset < len; ) {
+			auto event = reinterpret_cast<const inotify_event *>(buf + offset);
+			if (event->len > 0 && m_config_name == event->name) changed = true;
+			offset += sizeof(inotify_event) + event->len;
+		}
+	}
+	return changed;
+}
+
+void VisionReloader::reload() {
+	VisionConfig config;
+	if (!m_settings.config_file.empty()) {
+		std::string error;
+		auto file_config = read_vision_config(m_settings.config_file, error);
+		if (!file_config.has_value()) {
+			printf("warning: not reloading: %s\n", error.c_str());
+			return;
+		}
+		config = *file_config;
+	}
+
+	// the template is always read again, it may have been replaced on disk
+	apply(config);
+}
+
+void VisionReloader::apply(const VisionConfig& config) {
+	auto settings = m_vision.params();
+	apply_vision_config(config, settings);
+	auto template_file = config.template_file.value_or(m_settings.template_file);
+	std::string cache_file;
+	if (m_settings.use_cache) {
+		cache_file = m_settings.cache_file.empty() ? template_file + ".desc" : m_settings.cache_file;
+	}
+
+	VisionParams params;
+	try {
+		params = load_vision_params(template_file, cache_file, std::move(settings));
+	} catch (const std::runtime_error& err) {
+		printf("warning: keeping current vision parameters: %s\n", err.what());
+		return;
+	}
+
+	m_settings.template_file = template_file;
+	m_vision.set_params(std::move(params));
+	LOG_INFO("vision parameters reloaded, generation %llu", (unsigned long long) m_vision.params().generation);
+}
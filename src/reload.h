@@ -0,0 +1,90 @@
+#pragma once
+
+#include "types.h"
+#include "vision.h"
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// settings that can be changed while running, anything not set keeps its current value
+struct VisionConfig {
+	std::optional<cv::Scalar> thresh_min;
+	std::optional<cv::Scalar> thresh_max;
+	std::optional<int> morph_size;
+	std::optional<double> max_match;
+	std::optional<Extractor> extractor;
+	std::optional<Detector> detector;
+	// replaces all extra colour classes if the config has any
+	std::optional<std::vector<ColourClass>> classes;
+	std::optional<std::string> template_file;
+};
+
+// parses "key = value" lines, blank lines and lines starting with # are ignored
+// keys are thresh_min and thresh_max, each followed by three hsv values, morph_size, an odd kernel size,
+// max_match, the worst template match accepted, extractor, contours or blobs, detector, template or ball,
+// class, an extra colour class given by its thresh_min and thresh_max which can be repeated,
+// and template followed by a file name
+// six hsv values, the minimum then the maximum, separated by spaces or commas
+std::optional<ColourClass> parse_colour_class(const std::string& str);
+// "contours" or "blobs"
+std::optional<Extractor> parse_extractor(const std::string& str);
+// "template" or "ball"
+std::optional<Detector> parse_detector(const std::string& str);
+std::optional<VisionConfig> parse_vision_config(const std::string& text, std::string& error);
+std::optional<VisionConfig> read_vision_config(const std::string& file_name, std::string& error);
+// overwrites the settings in params which are set in config
+void apply_vision_config(const VisionConfig& config, VisionParams& params);
+
+// reads and processes a template image with the thresholds, morph_size and max_match from settings
+// the descriptor in cache_file is used and refreshed unless cache_file is empty
+// throws std::runtime_error describing what went wrong
+VisionParams load_vision_params(const std::string& template_file, const std::string& cache_file, VisionParams settings);
+
+struct ReloadSettings {
+	// template in use when the reloader is started
+	std::string template_file;
+	// watched for changes if not empty, and read again on every reload request
+	std::string config_file;
+	bool use_cache { true };
+	// empty to keep the descriptor next to the template, in the template file name with .desc appended
+	std::string cache_file;
+};
+
+// rebuilds the vision parameters on a low priority thread and swaps them in between frames
+// a reload is triggered by the config file changing, by reload_flag being set, or by a submitted config
+class VisionReloader {
+	public:
+		// reload_flag is only polled, so it can be set from a signal handler
+		VisionReloader(Vision& vision, ReloadSettings settings, std::atomic<bool>& reload_flag);
+		~VisionReloader();
+
+		// applies settings in the config file format, or reloads everything if config is "reload"
+		// never blocks for longer than it takes to queue the text
+		void submit(std::string config);
+
+	private:
+		static constexpr int POLL_MSEC = 200;
+
+		void run();
+		// true if the config file was written since the last call
+		bool config_changed();
+		void reload();
+		void apply(const VisionConfig& config);
+
+		Vision& m_vision;
+		ReloadSettings m_settings;
+		std::atomic<bool>& m_reload_flag;
+
+		int m_inotify_fd { -1 };
+		std::string m_config_name;
+
+		std::mutex m_submitted_lock;
+		std::vector<std::string> m_submitted;
+
+		std::atomic<bool> m_stop { false };
+		std::thread m_thread;
+};
@@ -0,0 +1,105 @@
+#include "render.h"
+#include "util.h"
+
+static const char *WINDOW_NAME = "Vision";
+
+cv::Mat compose_debug_frame(const DebugSnapshot& snapshot) {
+	auto img_show = snapshot.frame.clone();
+
+	char text[32];
+	int font_face = cv::FONT_HERSHEY_SIMPLEX;
+	double font_scale = 0.5;
+	cv::Point text_point(40, 40);
+
+	if (snapshot.target.has_value()) {
+		std::vector<std::vector<cv::Point>> contours { snapshot.contour };
+		cv::drawContours(img_show, contours, 0, cv::Scalar(0, 0, 255));
+		cv::rectangle(img_show, snapshot.rect, cv::Scalar(0, 255, 0));
+
+		snprintf(text, 32, "match: %6.2f", snapshot.match);
+		cv::putText(img_show, text, text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+		text_point.y += 15;
+		snprintf(text, 32, "distance: %6.2f", snapshot.target->distance);
+		cv::putText(img_show, text, text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+		text_point.y += 15;
+		snprintf(text, 32, "angle: %6.2f", snapshot.target->angle);
+		cv::putText(img_show, text, text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+	} else {
+		cv::putText(img_show, "match: none", text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+		text_point.y += 15;
+		cv::putText(img_show, "distance: unknown", text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+		text_point.y += 15;
+		cv::putText(img_show, "angle: unknown", text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+	}
+
+	cv::Mat mask_show;
+	cv::cvtColor(snapshot.mask, mask_show, cv::COLOR_GRAY2BGR);
+
+	cv::Mat out;
+	cv::hconcat(img_show, mask_show, out);
+	return out;
+}
+
+DebugRenderer::DebugRenderer(int max_fps, usize queue_len)
+: m_frame_usec(1000000 / std::max(max_fps, 1))
+, m_queue_len(std::max(queue_len, (usize) 1))
+, m_thread([this] () { run(); })
+{
+}
+
+DebugRenderer::~DebugRenderer() {
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	m_thread.join();
+}
+
+void DebugRenderer::submit(std::shared_ptr<DebugSnapshot> snapshot) {
+	if (snapshot == nullptr) return;
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_queue.size() >= m_queue_len) {
+			m_queue.pop_front();
+			m_dropped ++;
+			static auto& dropped = metrics_counter("vision_debug_frames_dropped_total", "debug snapshots dropped because the render thread couldn't keep up");
+			dropped.add();
+		}
+		m_queue.push_back(std::move(snapshot));
+	}
+	m_cond.notify_one();
+}
+
+u64 DebugRenderer::dropped() const {
+	return m_dropped;
+}
+
+void DebugRenderer::run() {
+	// lowest priority, so rendering only uses cpu time the processing threads don't need
+	set_low_priority();
+
+	cv::namedWindow(WINDOW_NAME);
+
+	for (;;) {
+		std::shared_ptr<DebugSnapshot> snapshot;
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_cond.wait(guard, [this] () { return m_stop || !m_queue.empty(); });
+			if (m_stop) break;
+
+			snapshot = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		long start_usec = get_usec();
+		cv::imshow(WINDOW_NAME, compose_debug_frame(*snapshot));
+
+		// waitKey also polls highgui events, and waiting out the rest of the frame caps the render rate
+		long remaining_usec = m_frame_usec - (get_usec() - start_usec);
+		cv::waitKey(std::max(remaining_usec / 1000, 1L));
+	}
+
+	cv::destroyWindow(WINDOW_NAME);
+}
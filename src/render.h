@@ -0,0 +1,42 @@
+#pragma once
+
+#include "types.h"
+#include "vision.h"
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// draws the annotated frame and the mask next to each other into a new image
+cv::Mat compose_debug_frame(const DebugSnapshot& snapshot);
+
+// draws debug snapshots into a single window on a separate low priority thread,
+// so the processing thread only pays for handing over the snapshot
+class DebugRenderer {
+	public:
+		DebugRenderer(int max_fps, usize queue_len = 2);
+		~DebugRenderer();
+
+		// never blocks, if the queue is full the oldest snapshot is dropped
+		void submit(std::shared_ptr<DebugSnapshot> snapshot);
+
+		// amount of snapshots dropped because the render thread couldn't keep up
+		u64 dropped() const;
+
+	private:
+		void run();
+
+		long m_frame_usec;
+		usize m_queue_len;
+
+		std::mutex m_lock;
+		std::condition_variable m_cond;
+		bool m_stop { false };
+		std::deque<std::shared_ptr<DebugSnapshot>> m_queue;
+		std::atomic<u64> m_dropped { 0 };
+
+		std::thread m_thread;
+};
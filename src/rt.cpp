@@ -0,0 +1,93 @@
+#include "rt.h"
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+std::optional<int> rt_parse_policy(const std::string& str) {
+	if (str == "fifo") return SCHED_FIFO;
+	if (str == "rr") return SCHED_RR;
+	if (str == "other") return SCHED_OTHER;
+	return {};
+}
+
+std::optional<std::vector<int>> rt_parse_cpus(const std::string& str) {
+	std::vector<int> out;
+	const char *pos = str.c_str();
+
+	while (*pos != '\0') {
+		char *end;
+		long first = strtol(pos, &end, 10);
+		if (end == pos || first < 0) return {};
+		long last = first;
+
+		pos = end;
+		if (*pos == '-') {
+			pos ++;
+			last = strtol(pos, &end, 10);
+			if (end == pos || last < first) return {};
+			pos = end;
+		}
+
+		for (long cpu = first; cpu <= last; cpu ++) {
+			out.push_back(cpu);
+		}
+
+		if (*pos == ',') {
+			pos ++;
+		} else if (*pos != '\0') {
+			return {};
+		}
+	}
+
+	return out;
+}
+
+void rt_apply_thread(const RtConfig& config, const char *thread_name) {
+	trace_thread_name(thread_name);
+	if (config.policy != SCHED_OTHER) {
+		sched_param param {};
+		param.sched_priority = config.priority;
+		int err = pthread_setschedparam(pthread_self(), config.policy, &param);
+		if (err) {
+			printf("warning: could not set real time priority %d for %s thread: %s, continuing with normal scheduling\n", config.priority, thread_name, strerror(err));
+		}
+	}
+
+	if (!config.cpus.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : config.cpus) {
+			if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+		}
+
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			printf("warning: could not set cpu affinity for %s thread: %s, continuing on any cpu\n", thread_name, strerror(err));
+		}
+	}
+}
+
+std::vector<int> rt_current_cpus() {
+	std::vector<int> out;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set)) return out;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu ++) {
+		if (CPU_ISSET(cpu, &set)) out.push_back(cpu);
+	}
+	return out;
+}
+
+bool rt_lock_memory() {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		printf("warning: could not lock memory: %s, pages may still fault\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
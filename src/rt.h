@@ -0,0 +1,31 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// real time settings for a single thread
+struct RtConfig {
+	// SCHED_OTHER leaves the scheduling policy alone
+	int policy;
+	int priority;
+	// cpus the thread may run on, empty to leave the affinity alone
+	std::vector<int> cpus;
+};
+
+// parses "fifo", "rr" or "other" into a scheduling policy
+std::optional<int> rt_parse_policy(const std::string& str);
+// parses a cpu list like "0,2-3"
+std::optional<std::vector<int>> rt_parse_cpus(const std::string& str);
+
+// applies config to the calling thread
+// thread_name must be a string literal, it also names the thread in traces
+// settings that fail, usually because of missing permissions, print a warning and are skipped
+void rt_apply_thread(const RtConfig& config, const char *thread_name);
+
+// cpus the calling thread may run on right now, empty if they couldn't be read
+std::vector<int> rt_current_cpus();
+
+// locks all current and future pages of the process into memory, so they never page fault after first use
+// prints a warning and returns false if the memlock limit or permissions don't allow it
+bool rt_lock_memory();
@@ -0,0 +1,120 @@
+#include "shm_result.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a write is a few stores, so a result still changing after this many attempts means the writer died in the middle of one
+static const int READ_ATTEMPTS = 1000;
+
+static void *map_segment(const std::string& name, bool create) {
+	int fd = create ? shm_open(name.c_str(), O_RDWR | O_CREAT, 0644) : shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0) return nullptr;
+
+	if (create && ftruncate(fd, sizeof(ShmResultSegment))) {
+		close(fd);
+		return nullptr;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || (usize) st.st_size < sizeof(ShmResultSegment)) {
+		close(fd);
+		return nullptr;
+	}
+
+	int prot = create ? PROT_READ | PROT_WRITE : PROT_READ;
+	void *mem = mmap(nullptr, sizeof(ShmResultSegment), prot, MAP_SHARED, fd, 0);
+	// the mapping stays valid after the file descriptor is closed
+	close(fd);
+	return mem == MAP_FAILED ? nullptr : mem;
+}
+
+ShmResultWriter::~ShmResultWriter() {
+	if (m_segment != nullptr) munmap(m_segment, sizeof(ShmResultSegment));
+}
+
+bool ShmResultWriter::open(const std::string& name) {
+	auto mem = map_segment(name, true);
+	if (mem == nullptr) return false;
+
+	m_segment = static_cast<ShmResultSegment *>(mem);
+	m_segment->magic = SHM_RESULT_MAGIC;
+	m_segment->version = SHM_RESULT_VERSION;
+	// a previous writer may have died half way through a write, leaving the sequence odd
+	u64 seq = m_segment->seq.load(std::memory_order_relaxed);
+	m_segment->seq.store(seq & ~1ul, std::memory_order_release);
+	return true;
+}
+
+bool ShmResultWriter::is_open() const {
+	return m_segment != nullptr;
+}
+
+void ShmResultWriter::write(const ShmResult& result) {
+	u64 words[ShmResultSegment::WORDS] {};
+	memcpy(words, &result, sizeof(ShmResult));
+
+	u64 seq = m_segment->seq.load(std::memory_order_relaxed);
+	m_segment->seq.store(seq + 1, std::memory_order_relaxed);
+	// the odd sequence must be visible before any of the new words
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (usize i = 0; i < ShmResultSegment::WORDS; i ++) {
+		m_segment->words[i].store(words[i], std::memory_order_relaxed);
+	}
+
+	m_segment->seq.store(seq + 2, std::memory_order_release);
+}
+
+ShmResultReader::~ShmResultReader() {
+	if (m_segment != nullptr) munmap(const_cast<ShmResultSegment *>(m_segment), sizeof(ShmResultSegment));
+}
+
+bool ShmResultReader::open(const std::string& name) {
+	auto mem = map_segment(name, false);
+	if (mem == nullptr) return false;
+
+	auto segment = static_cast<const ShmResultSegment *>(mem);
+	if (segment->magic != SHM_RESULT_MAGIC || segment->version != SHM_RESULT_VERSION) {
+		munmap(mem, sizeof(ShmResultSegment));
+		return false;
+	}
+
+	m_segment = segment;
+	return true;
+}
+
+bool ShmResultReader::is_open() const {
+	return m_segment != nullptr;
+}
+
+bool ShmResultReader::read(ShmResult& out) const {
+	u64 words[ShmResultSegment::WORDS];
+
+	for (int attempt = 0; ; attempt ++) {
+		if (attempt == READ_ATTEMPTS) return false;
+		// the writer may have been preempted in the middle of a write, so it is given the cpu
+		if (attempt > 0) sched_yield();
+
+		u64 seq_before = m_segment->seq.load(std::memory_order_acquire);
+		if (seq_before == 0) return false;
+		if (seq_before & 1) continue;
+
+		for (usize i = 0; i < ShmResultSegment::WORDS; i ++) {
+			words[i] = m_segment->words[i].load(std::memory_order_relaxed);
+		}
+
+		// the words must be read before the sequence is checked again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_segment->seq.load(std::memory_order_relaxed) == seq_before) break;
+	}
+
+	memcpy(&out, words, sizeof(ShmResult));
+	return true;
+}
+
+u64 ShmResultReader::seq() const {
+	return m_segment->seq.load(std::memory_order_acquire);
+}
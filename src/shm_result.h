@@ -0,0 +1,67 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <string>
+
+// latest result written to shared memory, for consumers running on the same machine
+struct ShmResult {
+	// sequence number of the frame this result is for
+	u64 frame;
+	// microseconds since the unix epoch when the frame was captured and when the result was written
+	i64 capture_usec;
+	i64 publish_usec;
+	u64 found;
+	double distance;
+	double angle;
+};
+
+static const u32 SHM_RESULT_MAGIC = 0x56495352;
+static const u32 SHM_RESULT_VERSION = 1;
+
+// layout of the shared memory segment, guarded by a seqlock
+// the writer never waits for readers, readers retry if the result changed while they were copying it
+struct ShmResultSegment {
+	static constexpr usize WORDS = (sizeof(ShmResult) + 7) / 8;
+
+	u32 magic;
+	u32 version;
+	// odd while the writer is updating the result, 0 if nothing has been written yet
+	std::atomic<u64> seq;
+	// the result is stored as atomic words so concurrent reads are not a data race
+	std::atomic<u64> words[WORDS];
+};
+
+class ShmResultWriter {
+	public:
+		ShmResultWriter() = default;
+		~ShmResultWriter();
+
+		// creates the segment if it doesn't exist, name must start with a '/'
+		bool open(const std::string& name);
+		bool is_open() const;
+
+		void write(const ShmResult& result);
+
+	private:
+		ShmResultSegment *m_segment { nullptr };
+};
+
+class ShmResultReader {
+	public:
+		ShmResultReader() = default;
+		~ShmResultReader();
+
+		// fails if the segment doesn't exist or was written by an incompatible version
+		bool open(const std::string& name);
+		bool is_open() const;
+
+		// copies the newest result into out, returns false if no result has been written yet,
+		// or if it kept changing or stayed half written for a bounded number of retries, like when the writer died mid write
+		bool read(ShmResult& out) const;
+		// sequence counter of the segment, changes every time a result is written
+		u64 seq() const;
+
+	private:
+		const ShmResultSegment *m_segment { nullptr };
+};
@@ -0,0 +1,320 @@
+#include "soak.h"
+#include "util.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+
+// windows before this are left out of the trends, caches and pools fill up while the process warms up
+static const usize WARMUP_WINDOWS = 2;
+// one sided 99% critical value of the t distribution, close enough for the amount of windows a soak has
+static const double TREND_T_CRITICAL = 2.6;
+// growth over the whole run below this fraction of the mean is not worth failing for, however significant
+static const double TREND_MIN_GROWTH = 0.05;
+
+// bytes malloc has handed out and not had back
+static double heap_bytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	return mallinfo2().uordblks;
+#else
+	// mallinfo's fields are ints, which wrap past 2 GB, but a heap that big has already failed a soak on rss
+	return (unsigned) mallinfo().uordblks;
+#endif
+}
+
+static double rss_mb() {
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == nullptr) return 0.0;
+	long pages = 0;
+	long resident = 0;
+	if (fscanf(file, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(file);
+	return resident * (double) sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static int open_fds() {
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == nullptr) return 0;
+	int count = 0;
+	while (auto entry = readdir(dir)) {
+		if (entry->d_name[0] != '.') count ++;
+	}
+	closedir(dir);
+	// the directory being listed is open too
+	return count - 1;
+}
+
+static double percentile(std::vector<long>& values, double q) {
+	if (values.empty()) return 0.0;
+	usize index = std::min<usize>(values.size() - 1, q * values.size());
+	std::nth_element(values.begin(), values.begin() + index, values.end());
+	return values[index];
+}
+
+SoakMonitor::SoakMonitor(long duration_sec, long window_sec)
+: m_start_usec(get_usec())
+, m_window_start_usec(m_start_usec)
+, m_duration_usec(duration_sec * 1000000)
+, m_window_usec(window_sec * 1000000)
+, m_window_allocations(soak_allocations())
+{
+	m_latencies.reserve(1 << 16);
+}
+
+bool SoakMonitor::record(long latency_usec) {
+	m_latencies.push_back(latency_usec);
+
+	long now_usec = get_usec();
+	if (now_usec - m_window_start_usec >= m_window_usec) {
+		sample(now_usec);
+	}
+	return now_usec - m_start_usec < m_duration_usec;
+}
+
+void SoakMonitor::sample(long now_usec) {
+	u64 allocations = soak_allocations();
+
+	SoakSample out;
+	out.elapsed_sec = (now_usec - m_start_usec) / 1e6;
+	out.rss_mb = rss_mb();
+	out.heap_mb = heap_bytes() / (1024.0 * 1024.0);
+	out.frames = m_latencies.size();
+	out.allocations_per_frame = out.frames > 0 ? (double) (allocations - m_window_allocations) / out.frames : 0.0;
+	out.fds = open_fds();
+	out.p50_usec = percentile(m_latencies, 0.5);
+	out.p99_usec = percentile(m_latencies, 0.99);
+	m_samples.push_back(out);
+
+	m_latencies.clear();
+	m_window_start_usec = now_usec;
+	// sampling allocates too, which should not count towards the next window
+	m_window_allocations = soak_allocations();
+}
+
+struct Trend {
+	double slope;
+	double t;
+	double growth;
+	bool drifts;
+};
+
+// least squares line through the series against elapsed time, with the t statistic of its slope
+static Trend trend(const std::vector<SoakSample>& samples, double SoakSample::*field) {
+	Trend out { 0.0, 0.0, 0.0, false };
+	usize n = samples.size() > WARMUP_WINDOWS ? samples.size() - WARMUP_WINDOWS : 0;
+	if (n < 3) return out;
+
+	double mean_x = 0;
+	double mean_y = 0;
+	for (usize i = WARMUP_WINDOWS; i < samples.size(); i ++) {
+		mean_x += samples[i].elapsed_sec;
+		mean_y += samples[i].*field;
+	}
+	mean_x /= n;
+	mean_y /= n;
+
+	double sxx = 0;
+	double sxy = 0;
+	for (usize i = WARMUP_WINDOWS; i < samples.size(); i ++) {
+		double dx = samples[i].elapsed_sec - mean_x;
+		sxx += dx * dx;
+		sxy += dx * (samples[i].*field - mean_y);
+	}
+	if (sxx <= 0) return out;
+	out.slope = sxy / sxx;
+
+	double sse = 0;
+	for (usize i = WARMUP_WINDOWS; i < samples.size(); i ++) {
+		double residual = samples[i].*field - (mean_y + out.slope * (samples[i].elapsed_sec - mean_x));
+		sse += residual * residual;
+	}
+	double standard_error = sqrt(sse / (n - 2) / sxx);
+	// a perfectly straight line has no error, any slope on it is significant
+	out.t = standard_error > 0 ? out.slope / standard_error : (out.slope > 0 ? INFINITY : 0.0);
+
+	double span = samples.back().elapsed_sec - samples[WARMUP_WINDOWS].elapsed_sec;
+	out.growth = mean_y != 0 ? out.slope * span / fabs(mean_y) : 0.0;
+	out.drifts = out.t > TREND_T_CRITICAL && out.growth > TREND_MIN_GROWTH;
+	return out;
+}
+
+bool SoakMonitor::report() const {
+	printf("soak windows:\n");
+	printf("%9s %8s %9s %9s %12s %5s %9s %9s\n", "time s", "frames", "rss MB", "heap MB", "allocs/frame", "fds", "p50 usec", "p99 usec");
+	for (const auto& sample : m_samples) {
+		printf("%9.1f %8llu %9.2f %9.2f %12.2f %5.0f %9.0f %9.0f\n", sample.elapsed_sec, (unsigned long long) sample.frames,
+			sample.rss_mb, sample.heap_mb, sample.allocations_per_frame, sample.fds, sample.p50_usec, sample.p99_usec);
+	}
+
+	if (m_samples.size() < WARMUP_WINDOWS + 3) {
+		printf("warning: only %zu soak windows, at least %zu are needed to test for drift\n", m_samples.size(), WARMUP_WINDOWS + 3);
+		return true;
+	}
+
+	struct Series {
+		const char *name;
+		double SoakSample::*field;
+	};
+	const Series series[] = {
+		{ "rss", &SoakSample::rss_mb },
+		{ "heap", &SoakSample::heap_mb },
+		{ "allocations per frame", &SoakSample::allocations_per_frame },
+		{ "open fds", &SoakSample::fds },
+		{ "p50 latency", &SoakSample::p50_usec },
+		{ "p99 latency", &SoakSample::p99_usec },
+	};
+
+	bool ok = true;
+	printf("soak trends, after %zu warm up windows:\n", WARMUP_WINDOWS);
+	for (const auto& s : series) {
+		auto t = trend(m_samples, s.field);
+		printf("%-22s slope %+.4g/s  t %6.2f  growth %+6.1f%%  %s\n", s.name, t.slope, t.t, t.growth * 100, t.drifts ? "DRIFTING" : "ok");
+		if (t.drifts) ok = false;
+	}
+	return ok;
+}
+
+MqttStandIn::~MqttStandIn() {
+	m_stop = true;
+	if (m_thread.joinable()) m_thread.join();
+	if (m_listen_fd >= 0) close(m_listen_fd);
+}
+
+bool MqttStandIn::start() {
+	m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0) return false;
+
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t len = sizeof(addr);
+	if (bind(m_listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+		|| listen(m_listen_fd, 4) < 0
+		|| getsockname(m_listen_fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return false;
+	}
+	m_port = ntohs(addr.sin_port);
+
+	m_thread = std::thread([this] () {
+		run();
+	});
+	return true;
+}
+
+void MqttStandIn::run() {
+	while (!m_stop) {
+		pollfd poll_fd { m_listen_fd, POLLIN, 0 };
+		if (poll(&poll_fd, 1, 200) <= 0) continue;
+
+		int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) continue;
+		serve(fd);
+		close(fd);
+	}
+}
+
+// reads exactly len bytes, giving up when the client goes away or the stand in stops
+static bool read_exact(int fd, u8 *buf, usize len, const std::atomic<bool>& stop) {
+	while (len > 0) {
+		pollfd poll_fd { fd, POLLIN, 0 };
+		int ready = poll(&poll_fd, 1, 200);
+		if (stop) return false;
+		if (ready <= 0) continue;
+
+		ssize_t n = read(fd, buf, len);
+		if (n <= 0) return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const u8 *buf, usize len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0) return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+void MqttStandIn::serve(int fd) {
+	std::vector<u8> body;
+	for (;;) {
+		u8 header;
+		if (!read_exact(fd, &header, 1, m_stop)) return;
+
+		// remaining length is a varint of up to 4 bytes
+		usize length = 0;
+		for (int shift = 0; shift < 28; shift += 7) {
+			u8 byte;
+			if (!read_exact(fd, &byte, 1, m_stop)) return;
+			length |= (usize) (byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0) break;
+		}
+		body.resize(length);
+		if (length > 0 && !read_exact(fd, body.data(), length, m_stop)) return;
+
+		switch (header >> 4) {
+			case 1: {
+				// connect, accepted without looking at it
+				const u8 connack[] = { 0x20, 0x02, 0x00, 0x00 };
+				if (!write_all(fd, connack, sizeof(connack))) return;
+				break;
+			}
+			case 3: {
+				m_received.fetch_add(1, std::memory_order_relaxed);
+				int qos = (header >> 1) & 3;
+				if (qos == 0 || length < 2) break;
+				// the packet id follows the topic, qos 1 is acknowledged with puback and qos 2 with pubrec
+				usize topic_length = (body[0] << 8) | body[1];
+				if (length < topic_length + 4) return;
+				const u8 ack[] = { (u8) (qos == 1 ? 0x40 : 0x50), 0x02, body[topic_length + 2], body[topic_length + 3] };
+				if (!write_all(fd, ack, sizeof(ack))) return;
+				break;
+			}
+			case 6: {
+				// pubrel, finishing a qos 2 publish
+				if (length < 2) return;
+				const u8 pubcomp[] = { 0x70, 0x02, body[0], body[1] };
+				if (!write_all(fd, pubcomp, sizeof(pubcomp))) return;
+				break;
+			}
+			case 8: {
+				// subscribe, every topic is granted the qos it asked for
+				if (length < 2) return;
+				std::vector<u8> suback = { 0x90, 0x00, body[0], body[1] };
+				for (usize i = 2; i + 2 < length; ) {
+					usize topic_length = (body[i] << 8) | body[i + 1];
+					i += 2 + topic_length;
+					if (i >= length) return;
+					suback.push_back(body[i] & 3);
+					i ++;
+				}
+				suback[1] = suback.size() - 2;
+				if (!write_all(fd, suback.data(), suback.size())) return;
+				break;
+			}
+			case 12: {
+				const u8 pingresp[] = { 0xd0, 0x00 };
+				if (!write_all(fd, pingresp, sizeof(pingresp))) return;
+				break;
+			}
+			case 14:
+				return;
+			default:
+				break;
+		}
+	}
+}
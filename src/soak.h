@@ -0,0 +1,71 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// c++ heap allocations made by the whole process so far, counted per thread by the global operator new in soak_alloc.cpp
+u64 soak_allocations();
+
+// one sample of process resources, taken at the end of every soak window
+struct SoakSample {
+	double elapsed_sec;
+	double rss_mb;
+	double heap_mb;
+	double allocations_per_frame;
+	double fds;
+	double p50_usec;
+	double p99_usec;
+	u64 frames;
+};
+
+// samples the process over a long run in fixed windows, and at the end tests every series for an upward trend
+// a series drifts if the slope of its least squares line is significantly above zero and would grow it noticeably over the run
+class SoakMonitor {
+	public:
+		SoakMonitor(long duration_sec, long window_sec);
+
+		// records the processing time of a frame, returns false once the soak is over
+		bool record(long latency_usec);
+
+		// prints every window and the trend of each series, returns false if any of them drifts upward
+		bool report() const;
+
+	private:
+		void sample(long now_usec);
+
+		long m_start_usec;
+		long m_window_start_usec;
+		long m_duration_usec;
+		long m_window_usec;
+		u64 m_window_allocations;
+
+		std::vector<long> m_latencies;
+		std::vector<SoakSample> m_samples;
+};
+
+// just enough of an mqtt 3.1.1 broker on localhost for the main loop to publish to
+// it acknowledges connections, subscriptions and pings, and discards published messages after counting them
+class MqttStandIn {
+	public:
+		MqttStandIn() = default;
+		~MqttStandIn();
+
+		// listens on an ephemeral port, returns false if it can't
+		bool start();
+		int port() const { return m_port; }
+		u64 received() const { return m_received.load(std::memory_order_relaxed); }
+
+	private:
+		void run();
+		// handles packets until the client disconnects
+		void serve(int fd);
+
+		int m_listen_fd { -1 };
+		int m_port { 0 };
+		std::atomic<bool> m_stop { false };
+		std::atomic<u64> m_received { 0 };
+		std::thread m_thread;
+};
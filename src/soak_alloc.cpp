@@ -0,0 +1,55 @@
+#include "soak.h"
+#include <stdlib.h>
+#include <new>
+
+// the replaced global operator new and delete, only linked into soak builds so normal runs allocate straight from malloc
+
+// each thread counts its own allocations on its own cache line, so counting adds no contention between cores
+// the counters are only summed when the soak samples them
+struct alignas(64) AllocationCounter {
+	std::atomic<u64> count;
+	AllocationCounter *next;
+};
+
+// counters are never freed, so a thread's allocations still count after it exits, at 64 bytes per thread ever started
+static std::atomic<AllocationCounter *> g_counters { nullptr };
+static thread_local AllocationCounter *t_counter = nullptr;
+
+static AllocationCounter *thread_counter() {
+	if (t_counter != nullptr) return t_counter;
+
+	// malloc rather than new, which would count itself before the counter exists
+	auto counter = static_cast<AllocationCounter *>(malloc(sizeof(AllocationCounter)));
+	if (counter == nullptr) return nullptr;
+	new (counter) AllocationCounter { { 0 }, g_counters.load(std::memory_order_relaxed) };
+	while (!g_counters.compare_exchange_weak(counter->next, counter, std::memory_order_release, std::memory_order_relaxed)) {}
+	t_counter = counter;
+	return counter;
+}
+
+// counted here rather than sampled from malloc, so allocations freed straight away still show up
+void *operator new(size_t size) {
+	auto counter = thread_counter();
+	// only this thread writes its counter, so it doesn't need an atomic add
+	if (counter != nullptr) counter->count.store(counter->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	void *ptr = malloc(size == 0 ? 1 : size);
+	if (ptr == nullptr) throw std::bad_alloc();
+	return ptr;
+}
+
+// never inlined, gcc warns about free called on memory from operator new when it can see both, even in another file with lto
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept {
+	free(ptr);
+}
+
+u64 soak_allocations() {
+	u64 out = 0;
+	for (auto counter = g_counters.load(std::memory_order_acquire); counter != nullptr; counter = counter->next) {
+		out += counter->count.load(std::memory_order_relaxed);
+	}
+	return out;
+}
@@ -0,0 +1,171 @@
+#include "source.h"
+#include "util.h"
+#include "log.h"
+#include "metrics.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+bool CameraSource::open(const std::optional<std::string>& file_name, int width, int height, int fps) {
+	if (file_name.has_value()) {
+		m_cap.open(*file_name, cv::CAP_V4L2);
+	} else {
+		// cv::CAP_V4L2 is needed because by default it might use gstreamer, and because of a bug in opencv, this causes open to fail
+		// if this is ever run not on linux, this will likely need to be changed
+		m_cap.open(0, cv::CAP_V4L2);
+		m_cap.set(cv::CAP_PROP_FRAME_WIDTH, width);
+		m_cap.set(cv::CAP_PROP_FRAME_HEIGHT, height);
+		m_cap.set(cv::CAP_PROP_FPS, fps);
+	}
+
+	return m_cap.isOpened();
+}
+
+bool CameraSource::read(Frame& frame) {
+	// a new mat every frame, since frames still in flight may reference the previous one
+	frame.image = cv::Mat();
+	m_cap >> frame.image;
+	frame.capture_usec = get_usec();
+	frame.lease = nullptr;
+	return !frame.image.empty();
+}
+
+struct JpegDecoder {
+	jpeg_decompress_struct info;
+	jpeg_error_mgr error;
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
+};
+
+// the default handler exits the process, a corrupt frame should only drop that frame
+static void jpeg_error_exit(j_common_ptr info) {
+	auto decoder = static_cast<JpegDecoder *>(info->client_data);
+	(*info->err->format_message)(info, decoder->message);
+	longjmp(decoder->jump, 1);
+}
+
+// cameras often send frames with a few bytes missing at the end, which still decode fine, so warnings are ignored
+static void jpeg_emit_message(j_common_ptr info, int level) {
+}
+
+MjpegSource::MjpegSource()
+: m_decoder(std::make_unique<JpegDecoder>())
+{
+	auto& info = m_decoder->info;
+	info.err = jpeg_std_error(&m_decoder->error);
+	m_decoder->error.error_exit = jpeg_error_exit;
+	m_decoder->error.emit_message = jpeg_emit_message;
+	jpeg_create_decompress(&info);
+	info.client_data = m_decoder.get();
+}
+
+MjpegSource::~MjpegSource() {
+	jpeg_destroy_decompress(&m_decoder->info);
+}
+
+bool MjpegSource::open(const std::optional<std::string>& file_name, int width, int height, int fps, int scale_denom, cv::Rect roi) {
+	m_scale_denom = scale_denom;
+	m_roi = roi;
+
+	// cv::CAP_V4L2 for the same reasons as in CameraSource
+	if (file_name.has_value()) {
+		m_cap.open(*file_name, cv::CAP_V4L2);
+	} else {
+		m_cap.open(0, cv::CAP_V4L2);
+	}
+	m_cap.set(cv::CAP_PROP_FOURCC, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'));
+	if (!file_name.has_value()) {
+		m_cap.set(cv::CAP_PROP_FRAME_WIDTH, width);
+		m_cap.set(cv::CAP_PROP_FRAME_HEIGHT, height);
+		m_cap.set(cv::CAP_PROP_FPS, fps);
+	}
+	// hands out the compressed buffer instead of decoding it at full size
+	m_cap.set(cv::CAP_PROP_CONVERT_RGB, 0);
+
+	return m_cap.isOpened();
+}
+
+bool MjpegSource::read(Frame& frame) {
+	static auto& dropped = metrics_counter("vision_mjpeg_frames_dropped_total", "mjpeg frames dropped because they could not be decoded");
+
+	for (;;) {
+		if (!m_cap.read(m_raw) || m_raw.empty()) return false;
+		frame.capture_usec = get_usec();
+		frame.lease = nullptr;
+		// a new mat every frame, since frames still in flight may reference the previous one
+		frame.image = cv::Mat();
+
+		bool decoded = time<bool>("Decode", [&] () {
+			return decode(m_raw.data, m_raw.total() * m_raw.elemSize(), frame);
+		});
+		if (decoded) return true;
+		dropped.add();
+	}
+}
+
+bool MjpegSource::decode(const u8 *data, usize size, Frame& frame) {
+	auto& info = m_decoder->info;
+	// longjmp skips destructors, so only trivially destructible locals are used below
+	if (setjmp(m_decoder->jump)) {
+		jpeg_abort_decompress(&info);
+		LOG_RATE_LIMITED(LogLevel::Warn, 1000000, "dropping mjpeg frame: %s", m_decoder->message);
+		return false;
+	}
+
+	// libjpeg-turbo fills in the standard huffman tables that mjpeg frames usually leave out
+	jpeg_mem_src(&info, data, size);
+	jpeg_read_header(&info, TRUE);
+	info.scale_num = 1;
+	info.scale_denom = m_scale_denom;
+	info.out_color_space = JCS_EXT_BGR;
+	// the fast dct is slightly less accurate, which doesn't matter for a colour threshold
+	info.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&info);
+
+	cv::Rect full(0, 0, info.output_width, info.output_height);
+	cv::Rect roi = full;
+	if (!m_roi.empty()) {
+		int denom = m_scale_denom;
+		cv::Rect scaled(m_roi.x / denom, m_roi.y / denom, (m_roi.width + denom - 1) / denom, (m_roi.height + denom - 1) / denom);
+		roi = scaled & full;
+		// a camera that picked another resolution may not have the region at all
+		if (roi.empty()) roi = full;
+	}
+
+	// columns can only be cropped to whole blocks, so the crop may be widened to the left and right
+	JDIMENSION x = roi.x;
+	JDIMENSION width = roi.width;
+	if (roi.width < full.width) {
+		jpeg_crop_scanline(&info, &x, &width);
+	}
+	if (roi.y > 0) {
+		jpeg_skip_scanlines(&info, roi.y);
+	}
+
+	frame.image.create(roi.height, width, CV_8UC3);
+	while (info.output_scanline < (JDIMENSION) roi.br().y) {
+		JSAMPROW row = frame.image.ptr<u8>(info.output_scanline - roi.y);
+		jpeg_read_scanlines(&info, &row, 1);
+	}
+	// rows below the region are never decoded
+	jpeg_abort_decompress(&info);
+
+	frame.scale = 1.0 / m_scale_denom;
+	frame.offset = cv::Point(x, roi.y);
+	return true;
+}
+
+bool RingSource::open(const std::string& name) {
+	return m_reader.open(name);
+}
+
+bool RingSource::read(Frame& frame) {
+	FrameRingRef ref;
+	// if the producer stops publishing for this long it is assumed to be gone
+	if (!m_reader.read(ref, 5000000)) return false;
+
+	frame.image = ref.image;
+	frame.capture_usec = ref.capture_usec;
+	frame.lease = std::move(ref.lease);
+	return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "types.h"
+#include "frame.h"
+#include "frame_ring.h"
+#include <opencv2/opencv.hpp>
+#include <memory>
+#include <optional>
+#include <string>
+
+// somewhere frames come from
+class FrameSource {
+	public:
+		virtual ~FrameSource() = default;
+
+		// blocks until the next frame is available, returns false when there are no more frames
+		virtual bool read(Frame& frame) = 0;
+};
+
+// frames from a v4l2 camera or a video file
+class CameraSource : public FrameSource {
+	public:
+		// if file_name is not given, camera 0 is opened with the given resolution and frame rate
+		bool open(const std::optional<std::string>& file_name, int width, int height, int fps);
+
+		bool read(Frame& frame) override;
+
+	private:
+		cv::VideoCapture m_cap;
+};
+
+struct JpegDecoder;
+
+// frames from a v4l2 camera in mjpeg mode, decoded with libjpeg instead of by opencv
+// reduced scales are decoded in the dct domain, which is far cheaper than decoding at full size and resizing,
+// and rows outside the region of interest are skipped without being decoded
+class MjpegSource : public FrameSource {
+	public:
+		MjpegSource();
+		~MjpegSource();
+
+		// scale_denom is 1, 2, 4 or 8, roi is in pixels of the full camera frame, empty to decode the whole frame
+		bool open(const std::optional<std::string>& file_name, int width, int height, int fps, int scale_denom, cv::Rect roi);
+
+		// frames that fail to decode are dropped
+		bool read(Frame& frame) override;
+
+	private:
+		bool decode(const u8 *data, usize size, Frame& frame);
+
+		cv::VideoCapture m_cap;
+		// compressed frame from the camera
+		cv::Mat m_raw;
+		int m_scale_denom { 1 };
+		cv::Rect m_roi;
+		// kept between frames so its buffers are reused
+		std::unique_ptr<JpegDecoder> m_decoder;
+};
+
+// frames published into a shared memory ring by another process
+class RingSource : public FrameSource {
+	public:
+		bool open(const std::string& name);
+
+		bool read(Frame& frame) override;
+
+	private:
+		FrameRingReader m_reader;
+};
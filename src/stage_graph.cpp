@@ -0,0 +1,139 @@
+#include "stage_graph.h"
+#include "parallel.h"
+#include "util.h"
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <string>
+
+// time keeps the names it is given, so the joined names of fused passes are never freed
+static const char *intern_name(const std::string& name) {
+	static std::mutex lock;
+	static std::set<std::string> names;
+	std::lock_guard<std::mutex> guard(lock);
+	return names.insert(name).first->c_str();
+}
+
+// tiles are at least this many times the halo of their pass high, so the rows computed again around them are at most a quarter of each stage's work
+static const int MIN_TILE_HALOS = 8;
+
+void StageGraph::add(Stage stage) {
+	bool fuse = !m_passes.empty()
+		&& stage.access != StageAccess::Global
+		&& m_stages[m_passes.back().first].access != StageAccess::Global;
+	m_stages.push_back(std::move(stage));
+
+	if (fuse) {
+		auto& pass = m_passes.back();
+		pass.last = m_stages.size();
+		pass.name = intern_name(std::string {pass.name} + " + " + m_stages.back().name);
+	} else {
+		m_passes.push_back({ m_stages.size() - 1, m_stages.size(), m_stages.back().name });
+	}
+}
+
+bool StageGraph::empty() const {
+	return m_stages.empty();
+}
+
+void StageGraph::run(cv::Mat in, cv::Mat& out, StageScratch& scratch, int threads, int tile_rows) const {
+	scratch.images.resize(m_stages.size());
+
+	cv::Mat pass_in = in;
+	for (usize i = 0; i < m_passes.size(); i ++) {
+		const auto& pass = m_passes[i];
+		bool last_pass = i + 1 == m_passes.size();
+		// passes before the last leave their output with the kept images, for the next pass to read
+		cv::Mat& pass_out = last_pass ? out : scratch.images[pass.last - 1];
+		pass_out.create(in.size(), m_stages[pass.last - 1].type);
+		bool keep_last = last_pass && m_stages[pass.last - 1].keep;
+		for (usize j = pass.first; j < pass.last; j ++) {
+			if (m_stages[j].keep && (j + 1 < pass.last || keep_last)) {
+				scratch.images[j].create(in.size(), m_stages[j].type);
+			}
+		}
+
+		time(pass.name, [&] () {
+			const auto& first = m_stages[pass.first];
+			if (first.access == StageAccess::Global) {
+				first.func(pass_in, pass_out);
+				if (keep_last) pass_out.copyTo(scratch.images[pass.first]);
+			} else {
+				run_tiles(pass, pass_in, pass_out, keep_last, scratch, threads, tile_rows);
+			}
+		});
+		pass_in = pass_out;
+	}
+}
+
+void StageGraph::run_tiles(const Pass& pass, cv::Mat in, cv::Mat out, bool keep_last, StageScratch& scratch, int threads, int tile_rows) const {
+	// every stage has to get the rows covered by the halos of the stages after it right as well as the tile
+	int pass_halo = 0;
+	for (usize j = pass.first; j < pass.last; j ++) {
+		pass_halo += m_stages[j].halo;
+	}
+
+	threads = std::max(threads, 1);
+	if (threads == 1) {
+		// a single thread gains nothing from tiles, which would only compute the rows around each one twice
+		tile_rows = 0;
+	} else if (tile_rows > 0) {
+		tile_rows = std::max(tile_rows, MIN_TILE_HALOS * pass_halo);
+	}
+	int tiles = tile_rows > 0 ? (in.rows + tile_rows - 1) / tile_rows : threads;
+	if (scratch.tiles.size() < (usize) tiles) scratch.tiles.resize(tiles);
+
+	parallel_for(tiles, 1, threads, [&] (int begin, int end) {
+		for (int i = begin; i < end; i ++) {
+			TRACE_SCOPE("Strip");
+			int top_row;
+			int bottom_row;
+			if (tile_rows > 0) {
+				top_row = i * tile_rows;
+				bottom_row = std::min(top_row + tile_rows, in.rows);
+			} else {
+				// done this way to stop rounding errors causing missed rows
+				top_row = in.rows * i / threads;
+				bottom_row = in.rows * (i + 1) / threads;
+			}
+
+			auto& buffers = scratch.tiles[i];
+			buffers.resize(m_stages.size());
+
+			// src holds the previous stage's output from row src_top of the image
+			cv::Mat src = in;
+			int src_top = 0;
+			int margin = pass_halo;
+			for (usize j = pass.first; j < pass.last; j ++) {
+				const auto& stage = m_stages[j];
+				bool last_stage = j + 1 == pass.last;
+				int y0 = std::max(top_row - margin, 0);
+				int y1 = std::min(bottom_row + margin, in.rows);
+				margin -= stage.halo;
+
+				// the last stage writes straight to the output when it doesn't compute rows outside the tile
+				cv::Mat stage_out;
+				if (last_stage && y0 == top_row && y1 == bottom_row) {
+					stage_out = out.rowRange(top_row, bottom_row);
+				} else {
+					buffers[j].create(y1 - y0, in.cols, stage.type);
+					stage_out = buffers[j];
+				}
+				stage.func(src.rowRange(y0 - src_top, y1 - src_top), stage_out);
+
+				cv::Mat tile_out = stage_out.rowRange(top_row - y0, bottom_row - y0);
+				if (last_stage && stage_out.data != out.ptr(top_row)) {
+					cv::Mat dst = out.rowRange(top_row, bottom_row);
+					tile_out.copyTo(dst);
+				}
+				if (stage.keep && (!last_stage || keep_last)) {
+					cv::Mat dst = scratch.images[j].rowRange(top_row, bottom_row);
+					tile_out.copyTo(dst);
+				}
+
+				src = stage_out;
+				src_top = y0;
+			}
+		}
+	});
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "types.h"
+#include <opencv2/opencv.hpp>
+#include <functional>
+#include <vector>
+
+// how a stage reads its input, which decides what it can be fused with
+enum class StageAccess {
+	// an output pixel only depends on the input pixel in the same place
+	Pointwise,
+	// an output pixel depends on input pixels up to halo rows above or below it
+	Neighbourhood,
+	// needs the whole input, so every stage before it has to finish first
+	Global,
+};
+
+// one image to image step of a StageGraph, the output is the same size as the input
+struct Stage {
+	// must be a string literal, like the names given to time
+	const char *name;
+	StageAccess access;
+	// type of the output image
+	int type;
+	int halo { 0 };
+	// pointwise and neighbourhood stages are called on tiles, several at once, in and out are the same size
+	// and rows less than halo from a tile edge that isn't an image edge are allowed to be wrong
+	// global stages are called once with the whole image
+	std::function<void(cv::Mat in, cv::Mat out)> func;
+	// also write the whole output to StageScratch::images, for use after the graph has run
+	bool keep { false };
+};
+
+// buffers of a StageGraph, reused between frames, so each thread running a graph needs its own
+struct StageScratch {
+	// intermediate outputs of each tile, indexed by tile and then by stage
+	std::vector<std::vector<cv::Mat>> tiles;
+	// whole outputs of kept stages and of stages ending a pass, indexed by stage
+	std::vector<cv::Mat> images;
+};
+
+// a chain of stages, each taking the output of the one before
+// runs of pointwise and neighbourhood stages are fused into one pass over tiles, each tile going through every stage of the pass
+// while it is still in cache, with enough rows around it computed to cover the halos of the later stages
+class StageGraph {
+	public:
+		// appends a stage and plans which pass it runs in
+		void add(Stage stage);
+		bool empty() const;
+		// runs every stage on in and leaves the output of the last one in out
+		// passes are split into tiles of tile_rows rows, or one per thread if tile_rows is 0, which run on up to threads threads
+		// tiles are made taller when tile_rows is small next to the halos of a pass, and a single thread runs each pass as one tile
+		void run(cv::Mat in, cv::Mat& out, StageScratch& scratch, int threads, int tile_rows) const;
+
+	private:
+		struct Pass {
+			usize first;
+			// one past the last stage
+			usize last;
+			// stage names joined with +, what the pass is timed as
+			const char *name;
+		};
+
+		void run_tiles(const Pass& pass, cv::Mat in, cv::Mat out, bool keep_last, StageScratch& scratch, int threads, int tile_rows) const;
+
+		std::vector<Stage> m_stages;
+		std::vector<Pass> m_passes;
+};
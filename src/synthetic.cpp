@@ -0,0 +1,130 @@
+#include "synthetic.h"
+#include "util.h"
+#include <math.h>
+#include <unistd.h>
+#include <algorithm>
+
+// frames per cycle of the target's motion along each axis, and of its size
+static const double TARGET_PERIOD_X = 240;
+static const double TARGET_PERIOD_Y = 370;
+static const double TARGET_PERIOD_SIZE = 500;
+// out of every TARGET_HIDE_PERIOD frames, the last TARGET_HIDE_FRAMES have no target
+static const u64 TARGET_HIDE_PERIOD = 600;
+static const u64 TARGET_HIDE_FRAMES = 60;
+static const usize NOISE_FRAMES = 4;
+
+static cv::Scalar hsv_to_bgr(const cv::Scalar& hsv) {
+	cv::Mat pixel(1, 1, CV_8UC3, hsv);
+	cv::cvtColor(pixel, pixel, cv::COLOR_HSV2BGR);
+	auto bgr = pixel.at<cv::Vec3b>(0, 0);
+	return cv::Scalar(bgr[0], bgr[1], bgr[2]);
+}
+
+void SyntheticSource::open(const SyntheticSettings& settings, const VisionParams& params) {
+	m_settings = settings;
+	m_index = 0;
+	m_next_usec = 0;
+	cv::RNG rng(settings.seed);
+
+	auto contour = params.tmpl.contour;
+	if (contour.size() < 3) {
+		// descriptors without a contour still get a round target
+		cv::ellipse2Poly(cv::Point(100, 100), cv::Size(100, 100), 0, 0, 360, 10, contour);
+	}
+	cv::Rect bounds = cv::boundingRect(contour);
+	m_shape.clear();
+	for (const auto& p : contour) {
+		m_shape.push_back(cv::Point2d((double) (p.x - bounds.x) / bounds.width, (double) (p.y - bounds.y) / bounds.width));
+	}
+	m_shape_height = (double) bounds.height / bounds.width;
+	cv::Scalar hsv;
+	for (int i = 0; i < 3; i ++) {
+		hsv[i] = (params.thresh_min[i] + params.thresh_max[i]) / 2;
+	}
+	m_target_colour = hsv_to_bgr(hsv);
+
+	m_background = cv::Mat(settings.height, settings.width, CV_8UC3, cv::Scalar(40, 40, 40));
+	m_noise.clear();
+	if (settings.noise > 0) {
+		for (usize i = 0; i < NOISE_FRAMES; i ++) {
+			cv::Mat noise(settings.height, settings.width, CV_16SC3);
+			cv::randn(noise, cv::Scalar::all(0), cv::Scalar::all(settings.noise));
+			m_noise.push_back(noise);
+		}
+	}
+
+	m_distractors.clear();
+	for (int i = 0; i < settings.distractors; i ++) {
+		Distractor distractor;
+		distractor.pos = cv::Point2d(rng.uniform(0.0, (double) settings.width), rng.uniform(0.0, (double) settings.height));
+		distractor.velocity = cv::Point2d(rng.uniform(-2.0, 2.0), rng.uniform(-2.0, 2.0));
+		int size = std::max(2, (int) (settings.width * rng.uniform(0.01, 0.04)));
+		distractor.bar = i % 2 == 0;
+		if (distractor.bar) {
+			distractor.axes = cv::Size(size * rng.uniform(3, 6), size);
+			distractor.colour = m_target_colour;
+		} else {
+			distractor.axes = cv::Size(size, (int) (size * rng.uniform(1.0, 2.0)));
+			distractor.colour = cv::Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+		}
+		m_distractors.push_back(distractor);
+	}
+}
+
+bool SyntheticSource::read(Frame& frame) {
+	const int width = m_settings.width;
+	const int height = m_settings.height;
+
+	if (m_settings.fps > 0) {
+		// paced from the previous deadline, unless rendering fell behind, then from now so it doesn't burst to catch up
+		long now_usec = get_usec();
+		m_next_usec = std::max(m_next_usec + 1000000 / m_settings.fps, now_usec);
+		if (m_next_usec > now_usec) usleep(m_next_usec - now_usec);
+	}
+
+	// a new mat every frame, since frames still in flight may reference the previous one
+	frame.image = m_background.clone();
+	for (auto& distractor : m_distractors) {
+		distractor.pos = distractor.pos + distractor.velocity;
+		if (distractor.pos.x < 0 || distractor.pos.x >= width) distractor.velocity.x = -distractor.velocity.x;
+		if (distractor.pos.y < 0 || distractor.pos.y >= height) distractor.velocity.y = -distractor.velocity.y;
+
+		cv::Point center(cvRound(distractor.pos.x), cvRound(distractor.pos.y));
+		if (distractor.bar) {
+			cv::Point half(distractor.axes.width / 2, distractor.axes.height / 2);
+			cv::rectangle(frame.image, center - half, center + half, distractor.colour, cv::FILLED);
+		} else {
+			cv::ellipse(frame.image, center, distractor.axes, 0, 0, 360, distractor.colour, cv::FILLED);
+		}
+	}
+
+	// motion only depends on the frame index, so runs at different frame rates see the same sequence of frames
+	double t = m_index;
+	frame.has_truth = true;
+	frame.truth = cv::Rect();
+	if (m_index % TARGET_HIDE_PERIOD < TARGET_HIDE_PERIOD - TARGET_HIDE_FRAMES) {
+		double target_width = width * (0.1 + 0.05 * sin(2 * M_PI * t / TARGET_PERIOD_SIZE));
+		double x = width / 2.0 + width * 0.35 * sin(2 * M_PI * t / TARGET_PERIOD_X) - target_width / 2;
+		double y = height / 2.0 + height * 0.3 * sin(2 * M_PI * t / TARGET_PERIOD_Y) - target_width * m_shape_height / 2;
+
+		m_polygon.resize(1);
+		auto& polygon = m_polygon[0];
+		polygon.clear();
+		for (const auto& p : m_shape) {
+			polygon.push_back(cv::Point(cvRound(x + p.x * target_width), cvRound(y + p.y * target_width)));
+		}
+		cv::fillPoly(frame.image, m_polygon, m_target_colour);
+		frame.truth = cv::boundingRect(polygon) & cv::Rect(0, 0, width, height);
+	}
+
+	if (!m_noise.empty()) {
+		cv::add(frame.image, m_noise[m_index % m_noise.size()], frame.image, cv::noArray(), CV_8U);
+	}
+
+	m_index ++;
+	frame.capture_usec = get_usec();
+	frame.lease = nullptr;
+	frame.scale = 1.0;
+	frame.offset = cv::Point();
+	return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.h"
+#include "source.h"
+#include "vision.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+struct SyntheticSettings {
+	int width { 640 };
+	int height { 480 };
+	// frames are paced to this rate, 0 renders them as fast as possible
+	int fps { 120 };
+	// blobs that aren't the target, half of them in the target colour but not its shape
+	int distractors { 8 };
+	// standard deviation of the gaussian noise added to every channel
+	double noise { 4.0 };
+	u64 seed { 1 };
+};
+
+// renders frames of a target shaped like the template contour moving across a cluttered scene
+// the target's bounding box is known, so every frame carries its ground truth
+// the target disappears for a while every few seconds, to also count false detections
+class SyntheticSource : public FrameSource {
+	public:
+		// the target is drawn in the middle of the threshold range of params
+		void open(const SyntheticSettings& settings, const VisionParams& params);
+
+		bool read(Frame& frame) override;
+
+	private:
+		struct Distractor {
+			cv::Point2d pos;
+			cv::Point2d velocity;
+			cv::Size axes;
+			cv::Scalar colour;
+			// target coloured distractors are long bars, the rest are ellipses
+			bool bar;
+		};
+
+		SyntheticSettings m_settings;
+		// template contour scaled to a width of 1, with its bounding box at the origin
+		std::vector<cv::Point2d> m_shape;
+		double m_shape_height { 1.0 };
+		cv::Scalar m_target_colour;
+
+		cv::Mat m_background;
+		// rendering noise for every frame would be slower than processing it, so a few frames of it are reused
+		std::vector<cv::Mat> m_noise;
+		std::vector<Distractor> m_distractors;
+		// reused between frames to avoid reallocations
+		std::vector<std::vector<cv::Point>> m_polygon;
+
+		u64 m_index { 0 };
+		long m_next_usec { 0 };
+};
@@ -0,0 +1,108 @@
+#include "template_cache.h"
+#include <stdio.h>
+#include <string.h>
+
+// descriptors are written in host byte order, they are a cache and not meant to be moved between machines
+static const u32 DESCRIPTOR_MAGIC = 0x4c505456;
+// bump whenever the layout or the way templates are processed changes, so old descriptors are ignored
+static const u32 DESCRIPTOR_VERSION = 1;
+// a template contour is never anywhere near this long, anything larger means the file is corrupt
+static const u32 MAX_CONTOUR_POINTS = 1 << 20;
+
+static u64 fnv1a(u64 hash, const void *data, usize len) {
+	auto bytes = static_cast<const u8 *>(data);
+	for (usize i = 0; i < len; i ++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+u64 template_cache_key(const std::vector<u8>& template_file, const cv::Scalar& thresh_min, const cv::Scalar& thresh_max, int morph_size, int extractor) {
+	u64 hash = 0xcbf29ce484222325;
+	hash = fnv1a(hash, &DESCRIPTOR_VERSION, sizeof(DESCRIPTOR_VERSION));
+	hash = fnv1a(hash, template_file.data(), template_file.size());
+	hash = fnv1a(hash, thresh_min.val, sizeof(thresh_min.val));
+	hash = fnv1a(hash, thresh_max.val, sizeof(thresh_max.val));
+	hash = fnv1a(hash, &morph_size, sizeof(morph_size));
+	hash = fnv1a(hash, &extractor, sizeof(extractor));
+	return hash;
+}
+
+template<typename T>
+static bool write_value(FILE *file, const T& value) {
+	return fwrite(&value, sizeof(T), 1, file) == 1;
+}
+
+template<typename T>
+static bool read_value(FILE *file, T& value) {
+	return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+bool save_template_descriptor(const std::string& path, const TemplateDescriptor& descriptor) {
+	// written to a temporary file first, so a restart during the write never sees half a descriptor
+	auto tmp_path = path + ".tmp";
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (file == nullptr) return false;
+
+	const auto& features = descriptor.features;
+	u32 point_count = features.contour.size();
+
+	bool ok = write_value(file, DESCRIPTOR_MAGIC)
+		&& write_value(file, DESCRIPTOR_VERSION)
+		&& write_value(file, descriptor.key)
+		&& write_value(file, descriptor.thresh_min.val)
+		&& write_value(file, descriptor.thresh_max.val)
+		&& write_value(file, features.area_frac)
+		&& write_value(file, features.log_hu)
+		&& write_value(file, features.hu_valid)
+		&& write_value(file, features.any_hu_nonzero)
+		&& write_value(file, point_count);
+
+	for (const auto& point : features.contour) {
+		i32 coords[2] = { point.x, point.y };
+		ok = ok && write_value(file, coords);
+	}
+
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+		remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::optional<TemplateDescriptor> load_template_descriptor(const std::string& path, u64 key) {
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == nullptr) return {};
+
+	TemplateDescriptor out;
+	auto& features = out.features;
+	u32 magic = 0;
+	u32 version = 0;
+	u32 point_count = 0;
+
+	bool ok = read_value(file, magic) && magic == DESCRIPTOR_MAGIC
+		&& read_value(file, version) && version == DESCRIPTOR_VERSION
+		&& read_value(file, out.key) && out.key == key
+		&& read_value(file, out.thresh_min.val)
+		&& read_value(file, out.thresh_max.val)
+		&& read_value(file, features.area_frac)
+		&& read_value(file, features.log_hu)
+		&& read_value(file, features.hu_valid)
+		&& read_value(file, features.any_hu_nonzero)
+		&& read_value(file, point_count) && point_count > 0 && point_count <= MAX_CONTOUR_POINTS;
+
+	if (ok) {
+		features.contour.resize(point_count);
+		for (auto& point : features.contour) {
+			i32 coords[2];
+			ok = ok && read_value(file, coords);
+			point = cv::Point(coords[0], coords[1]);
+		}
+	}
+
+	fclose(file);
+	if (!ok) return {};
+	return out;
+}
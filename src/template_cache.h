@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.h"
+#include "matcher.h"
+#include <opencv2/opencv.hpp>
+#include <optional>
+#include <string>
+#include <vector>
+
+// everything Vision needs from a template image, serialized so later starts can skip processing the image
+struct TemplateDescriptor {
+	// hash of the template file and the settings used to process it
+	u64 key;
+	cv::Scalar thresh_min;
+	cv::Scalar thresh_max;
+	TemplateFeatures features;
+};
+
+// hashes the raw template file, so a cached descriptor can be found without decoding the image
+u64 template_cache_key(const std::vector<u8>& template_file, const cv::Scalar& thresh_min, const cv::Scalar& thresh_max, int morph_size, int extractor);
+
+bool save_template_descriptor(const std::string& path, const TemplateDescriptor& descriptor);
+// returns nothing if the file is missing, corrupt, from another version, or was made for a different key
+std::optional<TemplateDescriptor> load_template_descriptor(const std::string& path, u64 key);
@@ -0,0 +1,133 @@
+#include "trace.h"
+#include "util.h"
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace trace_detail {
+	std::atomic<bool> g_enabled { false };
+}
+
+namespace {
+	struct TraceEvent {
+		const char *name;
+		long begin_usec;
+		long end_usec;
+	};
+
+	// written only by its thread, the count is published with release so the writer can read events while recording continues
+	struct TraceBuffer {
+		long tid;
+		std::atomic<const char *> thread_name { nullptr };
+		std::unique_ptr<TraceEvent[]> events;
+		usize capacity;
+		std::atomic<usize> count { 0 };
+		std::atomic<u64> dropped { 0 };
+	};
+
+	// buffers are kept after their thread exits, its spans are still needed in the trace
+	std::mutex g_buffers_lock;
+	std::vector<std::unique_ptr<TraceBuffer>> g_buffers;
+	std::atomic<usize> g_capacity { 0 };
+
+	thread_local TraceBuffer *t_buffer = nullptr;
+	// a thread named before tracing started has no buffer yet
+	thread_local const char *t_thread_name = nullptr;
+
+	TraceBuffer *thread_buffer() {
+		if (t_buffer != nullptr) return t_buffer;
+		// pairs with trace_start, so the capacity is seen
+		trace_detail::g_enabled.load(std::memory_order_acquire);
+
+		auto buffer = std::make_unique<TraceBuffer>();
+		buffer->tid = syscall(SYS_gettid);
+		buffer->thread_name.store(t_thread_name, std::memory_order_relaxed);
+		buffer->capacity = g_capacity.load(std::memory_order_relaxed);
+		buffer->events = std::make_unique<TraceEvent[]>(buffer->capacity);
+
+		std::lock_guard<std::mutex> guard(g_buffers_lock);
+		t_buffer = buffer.get();
+		g_buffers.push_back(std::move(buffer));
+		return t_buffer;
+	}
+
+	// names are string literals, but may still contain characters json needs escaped
+	void write_json_string(FILE *file, const char *str) {
+		fputc('"', file);
+		for (; *str != '\0'; str ++) {
+			if (*str == '"' || *str == '\\') fputc('\\', file);
+			fputc(*str, file);
+		}
+		fputc('"', file);
+	}
+}
+
+long TraceScope::trace_now() {
+	return get_usec();
+}
+
+void trace_start(usize events_per_thread) {
+	g_capacity.store(events_per_thread, std::memory_order_relaxed);
+	trace_detail::g_enabled.store(true, std::memory_order_release);
+}
+
+void trace_record(const char *name, long begin_usec, long end_usec) {
+	if (!trace_enabled()) return;
+
+	auto buffer = thread_buffer();
+	usize count = buffer->count.load(std::memory_order_relaxed);
+	if (count >= buffer->capacity) {
+		buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	buffer->events[count] = { name, begin_usec, end_usec };
+	buffer->count.store(count + 1, std::memory_order_release);
+}
+
+void trace_thread_name(const char *name) {
+	t_thread_name = name;
+	if (t_buffer != nullptr) t_buffer->thread_name.store(name, std::memory_order_relaxed);
+}
+
+bool trace_write(const std::string& file_name) {
+	trace_detail::g_enabled.store(false, std::memory_order_relaxed);
+
+	FILE *file = fopen(file_name.c_str(), "w");
+	if (file == nullptr) return false;
+
+	u64 dropped = 0;
+	const long pid = getpid();
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+	bool first = true;
+	std::lock_guard<std::mutex> guard(g_buffers_lock);
+	for (const auto& buffer : g_buffers) {
+		const char *thread_name = buffer->thread_name.load(std::memory_order_relaxed);
+		if (thread_name != nullptr) {
+			fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":", first ? "" : ",\n", pid, buffer->tid);
+			write_json_string(file, thread_name);
+			fputs("}}", file);
+			first = false;
+		}
+
+		// spans are complete events, which take half the space of separate begin and end events
+		usize count = buffer->count.load(std::memory_order_acquire);
+		for (usize i = 0; i < count; i ++) {
+			const auto& event = buffer->events[i];
+			fprintf(file, "%s{\"ph\":\"X\",\"name\":", first ? "" : ",\n");
+			write_json_string(file, event.name);
+			fprintf(file, ",\"pid\":%ld,\"tid\":%ld,\"ts\":%ld,\"dur\":%ld}", pid, buffer->tid, event.begin_usec, event.end_usec - event.begin_usec);
+			first = false;
+		}
+		dropped += buffer->dropped.load(std::memory_order_relaxed);
+	}
+	fputs("\n]}\n", file);
+
+	bool ok = fclose(file) == 0;
+	if (dropped > 0) {
+		printf("warning: %llu trace events dropped because a thread's trace buffer was full\n", (unsigned long long) dropped);
+	}
+	return ok;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <string>
+
+// timeline of named spans on every thread, written out as chrome trace event json which perfetto and chrome://tracing load
+// until trace_start is called recording a span is a single relaxed load
+// span and thread names must be string literals, only the pointers are stored
+
+namespace trace_detail {
+	extern std::atomic<bool> g_enabled;
+}
+
+inline bool trace_enabled() {
+	return trace_detail::g_enabled.load(std::memory_order_relaxed);
+}
+
+// starts recording, each thread records up to events_per_thread spans and drops the rest
+void trace_start(usize events_per_thread = 1 << 16);
+// stops recording and writes everything recorded so far, returns false if the file could not be written
+bool trace_write(const std::string& file_name);
+
+// records a span on the calling thread, times are from get_usec
+void trace_record(const char *name, long begin_usec, long end_usec);
+// names the calling thread in the trace
+void trace_thread_name(const char *name);
+
+// records the span from its construction to its destruction
+class TraceScope {
+	public:
+		explicit TraceScope(const char *name)
+		: m_name(name)
+		, m_begin_usec(trace_enabled() ? trace_now() : 0)
+		{
+		}
+
+		~TraceScope() {
+			if (m_begin_usec != 0) trace_record(m_name, m_begin_usec, trace_now());
+		}
+
+		TraceScope(const TraceScope&) = delete;
+		TraceScope& operator=(const TraceScope&) = delete;
+
+	private:
+		static long trace_now();
+
+		const char *m_name;
+		long m_begin_usec;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
@@ -0,0 +1,133 @@
+#include "types.h"
+#include "argparse.hpp"
+#include "vision.h"
+#include "util.h"
+#include "synthetic.h"
+#include <opencv2/opencv.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// renders synthetic frames the way --synthetic does and runs them through Vision::process
+// it is the training workload for profile guided builds, and the benchmark used to compare builds
+
+// frames are generated up front and cycled through, so generating them doesn't end up in the profile
+static const int FRAME_POOL = 32;
+
+int main(int argc, char **argv) {
+	argparse::ArgumentParser program("vision_train", "0.1.0");
+
+	program.add_argument("--frames")
+		.help("amount of frames to process")
+		.default_value(1000)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--width")
+		.help("synthesized frame width")
+		.default_value(320)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--height")
+		.help("synthesized frame height")
+		.default_value(240)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--threads")
+		.help("amount of threads to use for parallel processing")
+		.default_value(4)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--distractors")
+		.help("amount of blobs in each frame that aren't the target, half of them in the target colour")
+		.default_value(50)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("template")
+		.help("template image file to process");
+
+	try {
+		program.parse_args (argc, argv);
+	} catch (const std::runtime_error& err) {
+		std::cout << err.what() << std::endl;
+		std::cout << program;
+		exit(1);
+	}
+
+	const int frame_count = program.get<int>("--frames");
+	const int threads = program.get<int>("--threads");
+	const cv::Size size(program.get<int>("--width"), program.get<int>("--height"));
+
+	if (frame_count < 1 || threads < 1 || size.empty()) {
+		printf("error: frames, threads, width and height must be at least 1\n");
+		exit(1);
+	}
+	cv::setNumThreads(threads);
+
+	auto template_file = program.get("template");
+	auto template_img = cv::imread(template_file, cv::IMREAD_COLOR);
+	if (template_img.empty()) {
+		printf("template file '%s' empty or missing\n", template_file.c_str());
+		exit(1);
+	}
+
+	std::optional<Vision> vis_storage;
+	try {
+		vis_storage.emplace(template_img, threads);
+	} catch (const std::runtime_error& err) {
+		printf("error: template file '%s': %s\n", template_file.c_str(), err.what());
+		exit(1);
+	}
+	const Vision& vis = *vis_storage;
+
+	SyntheticSettings synthetic;
+	synthetic.width = size.width;
+	synthetic.height = size.height;
+	synthetic.fps = 0;
+	synthetic.distractors = program.get<int>("--distractors");
+	// a fixed seed so every build is trained and benchmarked on the same frames
+	synthetic.seed = 0x5eed;
+	SyntheticSource source;
+	source.open(synthetic, vis.params());
+
+	std::vector<cv::Mat> frames;
+	Frame frame;
+	for (int i = 0; i < FRAME_POOL; i ++) {
+		source.read(frame);
+		frames.push_back(frame.image);
+	}
+
+	VisionContext ctx;
+	std::vector<long> times;
+	times.reserve(frame_count);
+	int found = 0;
+
+	for (int i = 0; i < frame_count; i ++) {
+		long start_usec = get_usec();
+		auto target = vis.process(frames[i % FRAME_POOL], ctx);
+		times.push_back(get_usec() - start_usec);
+
+		if (target.has_value()) found ++;
+	}
+
+	std::sort(times.begin(), times.end());
+	long total = 0;
+	for (long time : times) total += time;
+
+	printf("frames: %d  size: %dx%d  threads: %d\n", frame_count, size.width, size.height, threads);
+	printf("found target in %d frames\n", found);
+	printf("processing time (usec): mean %.1f  p50 %ld  p99 %ld  max %ld\n",
+		(double) total / frame_count, times[times.size() / 2], times[times.size() * 99 / 100], times.back());
+	printf("throughput: %.1f fps\n", 1000000.0 * frame_count / std::max(total, 1L));
+}
@@ -1,5 +1,10 @@
 #include "util.h"
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
 // gets microseconds since unix epoch
 long get_usec()
@@ -9,13 +14,27 @@ long get_usec()
 	return 1000000 * tv.tv_sec + tv.tv_usec;
 }
 
+void set_low_priority()
+{
+	// threads inherit the policy of their creator, which may be a real time policy, so this switches back to idle scheduling
+	sched_param param {};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	// on linux nice values apply to individual threads, not the whole process
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+}
+
 void time(const char *op_name, std::function<void ()> op, long *out_time)
 {
 	long old_usec = get_usec();
-	op();
+	{
+		PerfStage perf_stage(op_name);
+		op();
+	}
 	long new_usec = get_usec();
 	long elapsed_usec = new_usec - old_usec;
 
-	printf("%s elapsed time: %ld usec\n", op_name, elapsed_usec);
+	LOG_DEBUG("%s elapsed time: %ld usec", op_name, elapsed_usec);
+	metrics_record_stage(op_name, elapsed_usec);
+	if (trace_enabled()) trace_record(op_name, old_usec, new_usec);
 	if (out_time != nullptr) *out_time = elapsed_usec;
 }
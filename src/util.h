@@ -1,19 +1,32 @@
 #pragma once
 
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "perf_counters.h"
 #include <functional>
 #include <stdio.h>
 
 long get_usec();
 
+// lowers the calling thread to the lowest scheduling priority, for background work like debug rendering
+void set_low_priority();
+
+// op_name must be a string literal, since it is logged asynchronously
 template<typename T>
 T time(const char *op_name, std::function<T ()> op, long *out_time = nullptr)
 {
 	long old_usec = get_usec();
-	auto ret = op();
+	T ret = [&] () {
+		PerfStage perf_stage(op_name);
+		return op();
+	} ();
 	long new_usec = get_usec();
 	long elapsed_usec = new_usec - old_usec;
 
-	printf("%s elapsed time: %ld usec\n", op_name, elapsed_usec);
+	LOG_DEBUG("%s elapsed time: %ld usec", op_name, elapsed_usec);
+	metrics_record_stage(op_name, elapsed_usec);
+	if (trace_enabled()) trace_record(op_name, old_usec, new_usec);
 	if (out_time != nullptr) *out_time = elapsed_usec;
 	return ret;
 }
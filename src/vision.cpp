@@ -3,32 +3,183 @@
 #include "util.h"
 #include "parallel.h"
 #include <math.h>
+#include <algorithm>
+#include <stdexcept>
 
-Vision::Vision(cv::Mat template_img, int threads, bool display)
+Vision::Vision(cv::Mat template_img, int threads)
+: Vision(make_vision_params(VisionParams {}, template_img), threads)
+{
+}
+
+Vision::Vision(VisionParams params, int threads)
 : m_threads(threads)
-, m_display(display)
+, m_params(std::make_unique<const VisionParams>(std::move(params)))
 {
-	process_template(template_img);
 }
 
 Vision::~Vision() {
 }
 
+static cv::Rect expand_rect(cv::Rect rect, int amount) {
+	return cv::Rect(rect.x - amount, rect.y - amount, rect.width + 2 * amount, rect.height + 2 * amount);
+}
+
 void Vision::set_threads(int threads) {
 	m_threads = threads;
 }
 
-void Vision::process_template(cv::Mat img) {
-	auto img_template = img.clone();
+void Vision::set_tile_rows(int tile_rows) {
+	m_tile_rows = tile_rows;
+}
+
+// opening erodes and then dilates, so an output pixel depends on input pixels up to twice the kernel radius away
+static int morph_halo(const VisionParams& params) {
+	return params.morph_kernel.empty() ? 0 : params.morph_size / 2 * 2;
+}
+
+static void open_mask(cv::Mat in, cv::Mat& out, const VisionParams& params) {
+	if (params.morph_kernel.empty()) {
+		in.copyTo(out);
+	} else {
+		cv::morphologyEx(in, out, cv::MORPH_OPEN, params.morph_kernel);
+	}
+}
+
+static void label_pixels(cv::Mat hsv, cv::Mat label, const u8 *lut) {
+	const u8 *lut_h = lut;
+	const u8 *lut_s = lut + 256;
+	const u8 *lut_v = lut + 512;
+	for (int y = 0; y < hsv.rows; y ++) {
+		const u8 *in = hsv.ptr<u8>(y);
+		u8 *out = label.ptr<u8>(y);
+		for (int x = 0; x < hsv.cols; x ++) {
+			out[x] = lut_h[in[3 * x]] & lut_s[in[3 * x + 1]] & lut_v[in[3 * x + 2]];
+		}
+	}
+}
+
+// 255 where the label has the class bit set, like the output of inRange
+static void class_mask(cv::Mat label, cv::Mat mask, int index) {
+	for (int y = 0; y < label.rows; y ++) {
+		const u8 *in = label.ptr<u8>(y);
+		u8 *out = mask.ptr<u8>(y);
+		for (int x = 0; x < label.cols; x ++) {
+			out[x] = -(u8) ((in[x] >> index) & 1);
+		}
+	}
+}
+
+// labelling comes straight after hsv conversion in the mask graph
+static const usize LABEL_STAGE = 1;
+
+// opening is an erode then a dilate, so a tile needs morph_halo rows of mask around it
+static Stage morph_stage(const char *name, const VisionParams& params) {
+	cv::Mat kernel = params.morph_kernel;
+	return { name, StageAccess::Neighbourhood, CV_8U, morph_halo(params), [kernel] (cv::Mat in, cv::Mat out) {
+		cv::morphologyEx(in, out, cv::MORPH_OPEN, kernel);
+	} };
+}
+
+// the graph a frame's mask is made with, class 0 is the target colour
+static StageGraph make_mask_graph(const VisionParams& params) {
+	StageGraph graph;
+	graph.add({ "HSV conversion", StageAccess::Pointwise, CV_8UC3, 0, [] (cv::Mat in, cv::Mat out) {
+		cv::cvtColor(in, out, cv::COLOR_BGR2HSV, 8);
+	} });
+
+	if (params.label_lut.empty()) {
+		cv::Scalar thresh_min = params.thresh_min;
+		cv::Scalar thresh_max = params.thresh_max;
+		graph.add({ "Threshold", StageAccess::Pointwise, CV_8U, 0, [thresh_min, thresh_max] (cv::Mat in, cv::Mat out) {
+			cv::inRange(in, thresh_min, thresh_max, out);
+		} });
+	} else {
+		// every class is labelled in the same pass, so extra classes only cost their own extraction
+		// the label image is kept for find_classes
+		auto lut = params.label_lut;
+		Stage labelling { "Labelling", StageAccess::Pointwise, CV_8U, 0, [lut] (cv::Mat in, cv::Mat out) {
+			label_pixels(in, out, lut.data());
+		} };
+		labelling.keep = true;
+		graph.add(std::move(labelling));
+		graph.add({ "Threshold", StageAccess::Pointwise, CV_8U, 0, [] (cv::Mat in, cv::Mat out) {
+			class_mask(in, out, 0);
+		} });
+	}
+
+	// without a kernel the thresholded mask is used as it is
+	if (!params.morph_kernel.empty()) {
+		graph.add(morph_stage("Morphology", params));
+	}
+	return graph;
+}
+
+// the graph the mask of an extra colour class is cut from the label image with
+static StageGraph make_class_graph(const VisionParams& params, int index) {
+	StageGraph graph;
+	graph.add({ "Class Threshold", StageAccess::Pointwise, CV_8U, 0, [index] (cv::Mat in, cv::Mat out) {
+		class_mask(in, out, index);
+	} });
+
+	if (!params.morph_kernel.empty()) {
+		graph.add(morph_stage("Class Morphology", params));
+	}
+	return graph;
+}
+
+VisionParams make_vision_params(VisionParams settings, TemplateFeatures features) {
+	if (settings.morph_size > 1) {
+		// a 3x3 rectangle is what morphologyEx uses when given an empty kernel
+		settings.morph_kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(settings.morph_size, settings.morph_size));
+	} else {
+		settings.morph_kernel = cv::Mat();
+	}
+	settings.tmpl = std::move(features);
+	settings.template_mask = cv::Mat();
+
+	settings.label_lut.clear();
+	if (!settings.extra_classes.empty()) {
+		if (settings.extra_classes.size() >= MAX_COLOUR_CLASSES) {
+			throw std::runtime_error("too many colour classes");
+		}
+
+		settings.label_lut.assign(3 * 256, 0);
+		for (usize i = 0; i <= settings.extra_classes.size(); i ++) {
+			// class 0 is the target colour
+			const auto& thresh_min = i == 0 ? settings.thresh_min : settings.extra_classes[i - 1].thresh_min;
+			const auto& thresh_max = i == 0 ? settings.thresh_max : settings.extra_classes[i - 1].thresh_max;
+			for (int channel = 0; channel < 3; channel ++) {
+				// rounded and clamped the way inRange converts its bounds, so class 0 is the same mask
+				int low = cv::saturate_cast<u8>(thresh_min[channel]);
+				int high = cv::saturate_cast<u8>(thresh_max[channel]);
+				for (int value = low; value <= high; value ++) {
+					settings.label_lut[channel * 256 + value] |= 1 << i;
+				}
+			}
+		}
+	}
+
+	settings.mask_graph = make_mask_graph(settings);
+	settings.class_graphs.clear();
+	for (usize i = 1; i <= settings.extra_classes.size(); i ++) {
+		settings.class_graphs.push_back(make_class_graph(settings, i));
+	}
+	return settings;
+}
+
+VisionParams make_vision_params(VisionParams settings, cv::Mat template_img) {
+	auto out = make_vision_params(std::move(settings), TemplateFeatures {});
+
+	auto img_template = template_img.clone();
 	cv::cvtColor(img_template, img_template, cv::COLOR_BGR2HSV, 8);
-	cv::inRange(img_template, m_thresh_min, m_thresh_max, img_template);
-	// TODO: pass kernel into morphologyEx instead of plain cv::Mat()
-	cv::morphologyEx(img_template, img_template, cv::MORPH_OPEN, cv::Mat());
+	cv::inRange(img_template, out.thresh_min, out.thresh_max, img_template);
+	open_mask(img_template, img_template, out);
 
 	std::vector<std::vector<cv::Point>> contours;
 	cv::findContours(img_template, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-
-	show_wait("Template", img_template);
+	if (contours.empty()) {
+		throw std::runtime_error("no contour found in template image");
+	}
 
 	// find largest contour
 	usize index = 0;
@@ -41,128 +192,322 @@ void Vision::process_template(cv::Mat img) {
 		}
 	}
 
-	m_template_contour.swap(contours[index]);
-	m_template_area_frac = max_area / cv::boundingRect(m_template_contour).area();
+	if (out.extractor == Extractor::Blobs) {
+		// the contour is only kept for drawing, the features have to be the same kind of moments frames are matched with
+		std::vector<Blob> blobs;
+		BlobScratch scratch;
+		extract_blobs(img_template, blobs, scratch, 1, 0);
+		auto largest = std::max_element(blobs.begin(), blobs.end(), [] (const Blob& a, const Blob& b) {
+			return a.m00 < b.m00;
+		});
+		out.tmpl = make_template_features(*largest, std::move(contours[index]));
+	} else {
+		out.tmpl = make_template_features(std::move(contours[index]));
+	}
+	// findContours doesn't modify its input since opencv 3.2
+	out.template_mask = img_template;
+	return out;
+}
+
+void Vision::process_template(cv::Mat img) {
+	set_params(make_vision_params(params(), img));
+}
+
+VisionParams Vision::params() const {
+	return *m_params.read();
+}
+
+void Vision::set_params(VisionParams params) {
+	std::lock_guard<std::mutex> lock(m_params_mutex);
+	params.generation = m_params.read()->generation + 1;
+	m_params.publish(std::make_unique<const VisionParams>(std::move(params)));
 }
 
 std::optional<Target> Vision::process(cv::Mat img) const {
+	VisionContext ctx;
+	return process(img, ctx);
+}
+
+std::optional<Target> Vision::process(cv::Mat img, VisionContext& ctx) const {
+	ctx.debug = nullptr;
+	perf_counters_add_pixels(img.total());
+	auto params = m_params.read();
+	build_mask(img, *params, ctx);
+	auto out = find_target(img, ctx.img_morph, *params, ctx);
+	find_classes(img, *params, ctx);
+	return out;
+}
+
+std::optional<Target> Vision::process_incremental(cv::Mat img, VisionContext& ctx, IncrementalState& state) const {
+	ctx.debug = nullptr;
+	ctx.class_targets.clear();
+	perf_counters_add_pixels(img.total());
+	auto params = m_params.read();
+
 	cv::Size size(img.cols, img.rows);
+	bool full_frame = state.prev.size() != size || state.prev.type() != img.type() || state.params_generation != params->generation;
+	if (full_frame) {
+		state.params_generation = params->generation;
+		state.prev.create(size, img.type());
+		state.thresh.create(size, CV_8U);
+		state.morph.create(size, CV_8U);
+		state.has_result = false;
+	}
 
-	show("Input", img);
+	auto& changed = state.changed;
+	changed.clear();
+	state.total_tiles = 0;
 
-	// TODO: figure out type of BGR mat
-	cv::Mat img_hsv(size, img.type());
-	time("HSV conversion", [&] () {
-		task(img, img_hsv, [] (cv::Mat in, cv::Mat out) {
-			cv::cvtColor(in, out, cv::COLOR_BGR2HSV, 8);
-		});
+	time("Change detection", [&] () {
+		for (int y = 0; y < size.height; y += state.tile_size) {
+			for (int x = 0; x < size.width; x += state.tile_size) {
+				cv::Rect tile = cv::Rect(x, y, state.tile_size, state.tile_size) & cv::Rect(0, 0, size.width, size.height);
+				state.total_tiles ++;
+
+				// sum of absolute differences over all channels of the tile
+				double limit = (double) state.change_threshold * tile.area() * img.channels();
+				if (full_frame || cv::norm(img(tile), state.prev(tile), cv::NORM_L1) > limit) {
+					changed.push_back(tile);
+				}
+			}
+		}
 	});
 
-	cv::Mat img_thresh(size, CV_8U);
+	if (changed.empty() && state.has_result) {
+		// nothing in the scene moved, so the mask and the blobs found in it are the same as last frame
+		if (ctx.capture_debug && state.debug != nullptr) {
+			ctx.debug = std::make_shared<DebugSnapshot>(*state.debug);
+			ctx.debug->frame = img;
+		}
+		return state.result;
+	}
+
 	time("Threshold", [&] () {
-		task(img_hsv, img_thresh, [&] (cv::Mat in, cv::Mat out) {
-			cv::inRange(in, m_thresh_min, m_thresh_max, out);
+		parallel_for(changed.size(), 1, m_threads, [&] (int begin, int end) {
+			cv::Mat tile_hsv;
+			for (int i = begin; i < end; i ++) {
+				auto tile = changed[i];
+				cv::cvtColor(img(tile), tile_hsv, cv::COLOR_BGR2HSV, 8);
+				cv::Mat tile_thresh = state.thresh(tile);
+				cv::inRange(tile_hsv, params->thresh_min, params->thresh_max, tile_thresh);
+
+				// only tiles which changed are copied, so slow drift accumulates until the tile is recomputed
+				img(tile).copyTo(state.prev(tile));
+			}
 		});
 	});
-	show("Threshold", img_thresh);
 
-	cv::Mat img_morph(size, CV_8U);
-	// TODO: pass kernel into morphologyEx instead of plain cv::Mat()
+	// a changed pixel can affect the opened mask up to halo pixels away,
+	// and computing the opened mask in that halo needs another halo pixels of threshold mask around it
+	const int halo = morph_halo(*params);
+	cv::Rect bounds(0, 0, size.width, size.height);
+	auto& tiles_morph = state.tiles_morph;
+	tiles_morph.resize(changed.size());
 	time("Morphology", [&] () {
-		cv::morphologyEx(img_thresh, img_morph, cv::MORPH_OPEN, cv::Mat());
-	});
-	show("Morphology", img_morph);
+		parallel_for(changed.size(), 1, m_threads, [&] (int begin, int end) {
+			for (int i = begin; i < end; i ++) {
+				auto out_rect = expand_rect(changed[i], halo) & bounds;
+				auto in_rect = expand_rect(out_rect, halo) & bounds;
 
-	// TODO: reserve eneough space in vector to prevent reallocations
-	std::vector<std::vector<cv::Point>> contours;
-	time("Contours", [&] () {
-		cv::findContours(img_morph, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+				// the threshold tile is copied so morphologyEx treats the edges of in_rect like image edges,
+				// which is only wrong in the halo that gets thrown away, except at real image edges where it is correct
+				cv::Mat in = state.thresh(in_rect).clone();
+				open_mask(in, tiles_morph[i], *params);
+
+				cv::Rect center(out_rect.x - in_rect.x, out_rect.y - in_rect.y, out_rect.width, out_rect.height);
+				tiles_morph[i] = tiles_morph[i](center);
+			}
+		});
+
+		// halos of neighbouring tiles overlap, so they are written back serially
+		for (usize i = 0; i < changed.size(); i ++) {
+			auto out_rect = expand_rect(changed[i], halo) & bounds;
+			tiles_morph[i].copyTo(state.morph(out_rect));
+		}
 	});
 
-	usize match_index = 0;
-	double best_match = INFINITY;
-	double best_area = 0.0;
+	// blobs can span many tiles, so contours are found again over the whole cached mask
+	state.result = find_target(img, state.morph, *params, ctx);
+	state.has_result = true;
+	// a copy without the frame, the caller may give the returned snapshot a lease which must not be held past the next frame
+	state.debug = nullptr;
+	if (ctx.debug != nullptr) {
+		state.debug = std::make_shared<DebugSnapshot>(*ctx.debug);
+		state.debug->frame = cv::Mat();
+	}
+	return state.result;
+}
 
-	time("Contour Matching", [&] () {
-		for (usize i = 0; i < contours.size(); i ++) {
-			auto contour = contours[i];
-			double match = cv::matchShapes(m_template_contour, contour, cv::CONTOURS_MATCH_I3, 0.0);
+void Vision::prefault(VisionContext& ctx, cv::Size size) const {
+	ctx.img_morph.create(size, CV_8U);
+	ctx.img_morph.setTo(cv::Scalar::all(0));
+	ctx.contours.reserve(256);
+	ctx.blobs.reserve(256);
+	ctx.class_targets.reserve(MAX_COLOUR_CLASSES);
 
-			double area = cv::contourArea(contour);
-			double area_frac = area / cv::boundingRect(contour).area();
+	// a blank frame also warms up the temporary buffers opencv allocates internally
+	bool capture_debug = ctx.capture_debug;
+	ctx.capture_debug = false;
+	process(cv::Mat(size, CV_8UC3, cv::Scalar::all(0)), ctx);
+	ctx.capture_debug = capture_debug;
+}
 
-			if (match < best_match && match < 1.5 && abs(area_frac - m_template_area_frac) / m_template_area_frac < 0.2 && area > best_area) {
-				best_match = match;
-				best_area = area;
-				match_index = i;
-			}
+void Vision::find_classes(cv::Mat img, const VisionParams& params, VisionContext& ctx) const {
+	ctx.class_targets.clear();
+	if (params.label_lut.empty()) return;
+
+	// the debug view only shows the target colour
+	bool capture_debug = ctx.capture_debug;
+	auto debug = std::move(ctx.debug);
+	ctx.capture_debug = false;
+
+	for (const auto& graph : params.class_graphs) {
+		graph.run(ctx.img_label, ctx.img_class_morph, ctx.class_stages, m_threads, m_tile_rows);
+		ctx.class_targets.push_back(find_target(img, ctx.img_class_morph, params, ctx));
+	}
+
+	ctx.capture_debug = capture_debug;
+	ctx.debug = std::move(debug);
+}
+
+void Vision::build_mask(cv::Mat img, const VisionParams& params, VisionContext& ctx) const {
+	// fused passes are timed as a whole, under the names of their stages joined together
+	params.mask_graph.run(img, ctx.img_morph, ctx.mask_stages, m_threads, m_tile_rows);
+	if (!params.label_lut.empty()) {
+		ctx.img_label = ctx.mask_stages.images[LABEL_STAGE];
+	}
+}
+
+// contour of the largest blob inside rect, only used for the debug view in blob mode
+static std::vector<cv::Point> largest_contour(cv::Mat mask, cv::Rect rect) {
+	std::vector<std::vector<cv::Point>> contours;
+	cv::findContours(mask(rect).clone(), contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE, rect.tl());
+
+	usize index = 0;
+	double max_area = -1;
+	for (usize i = 0; i < contours.size(); i ++) {
+		double area = cv::contourArea(contours[i]);
+		if (area > max_area) {
+			max_area = area;
+			index = i;
 		}
-	});
+	}
+	return contours.empty() ? std::vector<cv::Point>() : std::move(contours[index]);
+}
 
-	char text[32];
-	int font_face = cv::FONT_HERSHEY_SIMPLEX;
-	double font_scale = 0.5;
-	cv::Point text_point(40, 40);
+std::optional<Target> Vision::find_target(cv::Mat img, cv::Mat mask, const VisionParams& params, VisionContext& ctx) const {
+	if (params.detector == Detector::Ball) {
+		return find_ball(img, mask, ctx);
+	}
 
-	if (best_match == INFINITY) {
-		if (m_display) {
-			auto img_show = img.clone();
+	// TODO: reserve eneough space in vector to prevent reallocations
+	auto& contours = ctx.contours;
+	contours.clear();
+	ctx.blobs.clear();
 
-			cv::putText(img_show, "match: none", text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
-			text_point.y += 15;
-			cv::putText(img_show, "distance: unknown", text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
-			text_point.y += 15;
-			cv::putText(img_show, "angle: unknown", text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+	MatchResult match;
+	if (params.extractor == Extractor::Blobs) {
+		time("Blobs", [&] () {
+			extract_blobs(mask, ctx.blobs, ctx.blob_scratch, m_threads, m_tile_rows);
+		});
+		time("Contour Matching", [&] () {
+			match = match_blobs(ctx.blobs, params.tmpl, ctx.candidates, m_threads, params.max_match);
+		});
+	} else {
+		time("Contours", [&] () {
+			cv::findContours(mask, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+		});
+		time("Contour Matching", [&] () {
+			match = match_candidates(contours, params.tmpl, ctx.candidates, m_threads, params.max_match);
+		});
+	}
 
-			cv::imshow("Contours", img_show);
+	if (!match.found) {
+		if (ctx.capture_debug) {
+			ctx.debug = make_snapshot(img, mask, {}, cv::Rect(), match.match, {});
 		}
 		return {};
 	}
 
-	auto rect = cv::boundingRect(contours[match_index]);
+	bool blobs = params.extractor == Extractor::Blobs;
+	auto rect = blobs ? ctx.blobs[match.index].rect() : cv::boundingRect(contours[match.index]);
 	Target out;
-	out.distance = 11386.95362494479 * (1.0 / rect.width);
-	auto xpos = rect.x + rect.width / 2;
-	out.angle = atan((xpos - 320) / 530.47) * (180.0 / M_PI) + 16;
+	// the rect stays in frame coordinates, only the measurements are scaled back to the calibrated resolution
+	out.distance = target_distance(rect.width / ctx.scale);
+	auto xpos = ctx.offset.x + rect.x + rect.width / 2;
+	out.angle = target_angle(xpos / ctx.scale);
+	out.rect = rect;
+	out.match = match.match;
+
+	if (ctx.capture_debug) {
+		ctx.debug = make_snapshot(img, mask, blobs ? largest_contour(mask, rect) : contours[match.index], rect, match.match, out);
+	}
 
-	if (m_display) {
-		auto img_show = img.clone();
+	return out;
+}
 
-		cv::drawContours(img_show, contours, match_index, cv::Scalar(0, 0, 255));
-		cv::rectangle(img_show, rect, cv::Scalar(0, 255, 0));
+std::optional<Target> Vision::find_ball(cv::Mat img, cv::Mat mask, VisionContext& ctx) const {
+	ctx.contours.clear();
+	time("Blobs", [&] () {
+		extract_blobs(mask, ctx.blobs, ctx.blob_scratch, m_threads, m_tile_rows);
+	});
 
-		snprintf(text, 32, "match: %6.2f", best_match);
-		cv::putText(img_show, text, text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
-		text_point.y += 15;
-		snprintf(text, 32, "distance: %6.2f", out.distance);
-		cv::putText(img_show, text, text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
-		text_point.y += 15;
-		snprintf(text, 32, "angle: %6.2f", out.angle);
-		cv::putText(img_show, text, text_point, font_face, font_scale, cv::Scalar(0, 0, 255));
+	BallMatch match;
+	time("Ball Matching", [&] () {
+		match = match_ball(ctx.blobs);
+	});
 
-		cv::imshow("Contours", img_show);
+	Circle circle;
+	bool fitted = false;
+	cv::Rect rect;
+	if (match.found) {
+		rect = ctx.blobs[match.index].rect();
+		time("Circle Fit", [&] () {
+			blob_runs(ctx.blob_scratch, match.index, ctx.blob_runs);
+			fitted = fit_circle(ctx.blob_runs, rect, ctx.edge_points, circle);
+		});
+	}
+
+	if (!fitted) {
+		if (ctx.capture_debug) {
+			ctx.debug = make_snapshot(img, mask, {}, cv::Rect(), match.match, {});
+		}
+		return {};
+	}
+
+	Target out;
+	// the fitted diameter still measures a ball that is partly hidden, unlike the width of its bounding box
+	out.distance = target_distance(2 * circle.radius / ctx.scale);
+	out.angle = target_angle((ctx.offset.x + circle.center.x) / ctx.scale);
+	out.rect = rect;
+	out.match = match.match;
+
+	if (ctx.capture_debug) {
+		std::vector<cv::Point> outline;
+		cv::ellipse2Poly(cv::Point(cvRound(circle.center.x), cvRound(circle.center.y)), cv::Size(cvRound(circle.radius), cvRound(circle.radius)), 0, 0, 360, 10, outline);
+		ctx.debug = make_snapshot(img, mask, outline, rect, match.match, out);
 	}
 
 	return out;
 }
 
-void Vision::show(const std::string& name, cv::Mat& img) const {
-	if (m_display) {
-		cv::imshow(name, img);
-	}
+double target_distance(double width) {
+	return 11386.95362494479 * (1.0 / width);
 }
 
-void Vision::show_wait(const std::string& name, cv::Mat& img) const {
-	if (m_display) {
-		cv::imshow(name, img);
-		cv::waitKey();
-	}
+double target_angle(double center_x) {
+	return atan((center_x - 320) / 530.47) * (180.0 / M_PI) + 16;
 }
 
-void Vision::task(cv::Mat in, cv::Mat out, std::function<void(cv::Mat, cv::Mat)> func) const {
-	if (m_threads > 1) {
-		parallel_process(in, out, func, m_threads);
-	} else {
-		func(in, out);
-	}
+std::shared_ptr<DebugSnapshot> Vision::make_snapshot(cv::Mat img, cv::Mat mask, const std::vector<cv::Point>& contour, cv::Rect rect, double match, std::optional<Target> target) const {
+	auto snapshot = std::make_shared<DebugSnapshot>();
+	// the frame is not copied, callers whose frame is leased from its source put the lease in the snapshot too
+	// the mask is scratch space reused by the next frame
+	snapshot->frame = img;
+	snapshot->mask = mask.clone();
+	snapshot->contour = contour;
+	snapshot->rect = rect;
+	snapshot->match = match;
+	snapshot->target = target;
+	return snapshot;
 }
@@ -1,38 +1,217 @@
 #pragma once
 
+#include "types.h"
+#include "matcher.h"
+#include "blobs.h"
+#include "ball.h"
+#include "rcu.h"
+#include "stage_graph.h"
 #include <opencv2/opencv.hpp>
 #include <optional>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <mutex>
 
 // represents a detected target
 struct Target {
 	double distance;
 	double angle;
+	// bounding box of the target in the frame, and how well it matched the template (lower is better)
+	cv::Rect rect;
+	double match;
 };
 
+// everything needed to draw the debug view of a single frame
+struct DebugSnapshot {
+	cv::Mat frame;
+	cv::Mat mask;
+	// contour and bounding box of the matched target, empty if nothing matched
+	std::vector<cv::Point> contour;
+	cv::Rect rect;
+	double match;
+	std::optional<Target> target;
+	// lease of the frame, see Frame, held so a frame in memory owned by the source isn't overwritten while it is drawn
+	std::shared_ptr<void> lease;
+};
+
+// scratch buffers used by a single call to Vision::process
+// each thread calling process concurrently needs its own context, it can be reused between frames to avoid reallocations
+struct VisionContext {
+	StageScratch mask_stages;
+	StageScratch class_stages;
+	cv::Mat img_morph;
+	// class bits of every pixel, only made when there are extra colour classes
+	cv::Mat img_label;
+	cv::Mat img_class_morph;
+	std::vector<std::vector<cv::Point>> contours;
+	std::vector<Blob> blobs;
+	BlobScratch blob_scratch;
+	std::vector<BlobScratch::Run> blob_runs;
+	std::vector<cv::Point2d> edge_points;
+	CandidateTable candidates;
+
+	// size of the frame relative to the resolution distance and angle are calibrated for,
+	// set it when frames are downscaled before processing so targets are still measured correctly
+	double scale { 1.0 };
+	// position of the frame within the full frame, when only a region of it was captured, in frame pixels
+	cv::Point offset;
+
+	// filled in by process with the target found in each extra colour class, in the order of VisionParams::extra_classes
+	std::vector<std::optional<Target>> class_targets;
+
+	// if set, process fills in debug with a snapshot of the frame for debug rendering
+	bool capture_debug { false };
+	std::shared_ptr<DebugSnapshot> debug;
+};
+
+// state carried between frames by Vision::process_incremental
+// only tiles that changed since the last frame are thresholded again, the rest of the mask is reused
+// it must only be used for a single stream of frames processed in order
+struct IncrementalState {
+	// width and height of each tile in pixels
+	int tile_size { 32 };
+	// mean absolute difference per channel per pixel above which a tile counts as changed
+	int change_threshold { 8 };
+
+	// contents of each tile the last time it was processed
+	cv::Mat prev;
+	cv::Mat thresh;
+	cv::Mat morph;
+
+	// generation of the vision parameters the cached mask was made with, a reload recomputes every tile
+	u64 params_generation { 0 };
+
+	bool has_result { false };
+	std::optional<Target> result;
+	std::shared_ptr<DebugSnapshot> debug;
+
+	// tiles which changed in the last processed frame
+	std::vector<cv::Rect> changed;
+	usize total_tiles { 0 };
+	std::vector<cv::Mat> tiles_morph;
+};
+
+// small enough that there are several tiles per worker to balance, large enough to amortize scheduling
+static const int DEFAULT_TILE_ROWS = 16;
+
+// hsv range of the target colour
+static const cv::Scalar DEFAULT_THRESH_MIN(10, 70, 70);
+static const cv::Scalar DEFAULT_THRESH_MAX(40, 255, 255);
+
+// how candidates are extracted from the mask
+enum class Extractor {
+	// contours from findContours, matched with contour moments
+	Contours,
+	// connected components labelled in parallel strips, matched with the moments of their pixels
+	Blobs,
+};
+
+// what a target is recognized by
+enum class Detector {
+	// matched against the template shape with hu moments
+	Template,
+	// the largest round blob, measured by a circle fit to its edge, the template shape is not used
+	Ball,
+};
+
+// the target colour and every extra colour share one label byte per pixel, a bit for each
+static const usize MAX_COLOUR_CLASSES = 8;
+
+// hsv range of an extra colour to find targets in
+struct ColourClass {
+	cv::Scalar thresh_min;
+	cv::Scalar thresh_max;
+};
+
+// everything processing depends on that can be changed while running
+// it is never modified once in use, a change builds a new set which is swapped in between frames
+struct VisionParams {
+	// set by Vision when the parameters are swapped in, increases with every change
+	u64 generation { 0 };
+
+	cv::Scalar thresh_min { DEFAULT_THRESH_MIN };
+	cv::Scalar thresh_max { DEFAULT_THRESH_MAX };
+	// side of the square kernel the mask is opened with, 1 skips morphology
+	int morph_size { 3 };
+	// contours that match the template worse than this are never a target
+	double max_match { 1.5 };
+	// the template is matched with the same kind of moments, so changing it needs the template processed again
+	Extractor extractor { Extractor::Contours };
+	// the ball detector always works on blobs, whatever the extractor is
+	Detector detector { Detector::Template };
+	// targets of other colours found with the same detector and template, up to MAX_COLOUR_CLASSES - 1
+	// process_incremental only finds the target colour
+	std::vector<ColourClass> extra_classes;
+
+	// made from morph_size, empty if morphology is skipped
+	cv::Mat morph_kernel;
+	// made from the thresholds when there are extra classes, 256 entries for each of h, s and v
+	// with the bits of the classes whose range contains that value, so a pixel's label is the and of three lookups
+	std::vector<u8> label_lut;
+	// stages turning a frame into the opened mask of the target colour, made from everything above
+	StageGraph mask_graph;
+	// stages turning the label image into the opened mask of each extra class
+	std::vector<StageGraph> class_graphs;
+	TemplateFeatures tmpl {};
+	// thresholded template the template contour was taken from, for display
+	// empty if the parameters were made from template features
+	cv::Mat template_mask;
+};
+
+// settings gives the thresholds, morph_size and max_match, everything derived from them is filled in
+// thresholds the template image and extracts the features of its largest contour
+// throws std::runtime_error if no contour is found in the template
+VisionParams make_vision_params(VisionParams settings, cv::Mat template_img);
+// uses features that were already extracted from a template, for example from a cached descriptor
+VisionParams make_vision_params(VisionParams settings, TemplateFeatures features);
+
+// camera model, width and center_x are in pixels at the calibrated resolution of 640x480
+double target_distance(double width);
+double target_angle(double center_x);
+
 // TODO: come up with better class name
 class Vision {
 	public:
-		Vision(cv::Mat template_img, int threads, bool display);
+		// throws std::runtime_error if no contour is found in the template
+		Vision(cv::Mat template_img, int threads);
+		Vision(VisionParams params, int threads);
 		~Vision();
 
 		void set_threads(int threads);
+		// rows in each tile full frame stages are split into for parallel processing, 0 for one strip per thread
+		void set_tile_rows(int tile_rows);
 
+		// throws std::runtime_error if no contour is found in the template, the current parameters are kept then
 		void process_template(cv::Mat img);
+		// copy of the parameters in use right now
+		VisionParams params() const;
+		// swaps in new parameters, frames already being processed finish with the old ones
+		// blocks until no frame uses the old parameters, so it must not be called from a processing thread
+		void set_params(VisionParams params);
+		// safe to call from multiple threads at once, as long as each thread uses a different context
+		std::optional<Target> process(cv::Mat img, VisionContext& ctx) const;
 		std::optional<Target> process(cv::Mat img) const;
+		// allocates and touches the scratch buffers in ctx for frames of the given size,
+		// so the first real frames don't page fault or allocate
+		void prefault(VisionContext& ctx, cv::Size size) const;
+		// like process, but only recomputes the parts of the mask that changed since the previous frame
+		std::optional<Target> process_incremental(cv::Mat img, VisionContext& ctx, IncrementalState& state) const;
 
 	private:
-		void show(const std::string& name, cv::Mat& img) const;
-		void show_wait(const std::string& name, cv::Mat& img) const;
-		void task(cv::Mat in, cv::Mat out, std::function<void(cv::Mat, cv::Mat)> func) const;
+		void build_mask(cv::Mat img, const VisionParams& params, VisionContext& ctx) const;
+		std::optional<Target> find_target(cv::Mat img, cv::Mat mask, const VisionParams& params, VisionContext& ctx) const;
+		std::optional<Target> find_ball(cv::Mat img, cv::Mat mask, VisionContext& ctx) const;
+		// finds the targets of the extra colour classes in the label image made by build_mask
+		void find_classes(cv::Mat img, const VisionParams& params, VisionContext& ctx) const;
 
-		int m_threads;
-		bool m_display;
+		std::shared_ptr<DebugSnapshot> make_snapshot(cv::Mat img, cv::Mat mask, const std::vector<cv::Point>& contour, cv::Rect rect, double match, std::optional<Target> target) const;
 
-		cv::Scalar m_thresh_min { cv::Scalar(10, 70, 70) };
-		cv::Scalar m_thresh_max { cv::Scalar(40, 255, 255) };
+		int m_threads;
+		int m_tile_rows { DEFAULT_TILE_ROWS };
 
-		std::vector<cv::Point> m_template_contour {};
-		double m_template_area_frac { 0.0 };
+		// each call to process reads the parameters once, so a frame never mixes old and new ones
+		RcuCell<VisionParams> m_params;
+		// serializes set_params, so generations are handed out in the order the parameters are swapped in
+		std::mutex m_params_mutex;
 };
@@ -0,0 +1,102 @@
+#include "vision_c.h"
+#include "vision.h"
+#include <memory>
+#include <optional>
+
+struct vision {
+	std::unique_ptr<Vision> vision;
+	VisionContext ctx;
+	// frames that aren't already bgr are converted into this
+	cv::Mat converted;
+
+	bool has_result { false };
+	std::optional<Target> result;
+};
+
+// wraps the caller's buffer without copying, converting to bgr only if needed
+static bool to_bgr(const vision_image_t *img, cv::Mat& scratch, cv::Mat& out) {
+	if (img == nullptr || img->data == nullptr || img->width <= 0 || img->height <= 0) {
+		return false;
+	}
+
+	// opencv won't write through these mats, the const cast is only needed for the constructor
+	auto data = const_cast<uint8_t *>(img->data);
+	switch (img->format) {
+		case VISION_FORMAT_BGR24:
+			out = cv::Mat(img->height, img->width, CV_8UC3, data, img->stride);
+			return true;
+		case VISION_FORMAT_RGB24:
+			cv::cvtColor(cv::Mat(img->height, img->width, CV_8UC3, data, img->stride), scratch, cv::COLOR_RGB2BGR);
+			break;
+		case VISION_FORMAT_BGRA32:
+			cv::cvtColor(cv::Mat(img->height, img->width, CV_8UC4, data, img->stride), scratch, cv::COLOR_BGRA2BGR);
+			break;
+		case VISION_FORMAT_RGBA32:
+			cv::cvtColor(cv::Mat(img->height, img->width, CV_8UC4, data, img->stride), scratch, cv::COLOR_RGBA2BGR);
+			break;
+		case VISION_FORMAT_YUYV:
+			cv::cvtColor(cv::Mat(img->height, img->width, CV_8UC2, data, img->stride), scratch, cv::COLOR_YUV2BGR_YUYV);
+			break;
+		default:
+			return false;
+	}
+
+	out = scratch;
+	return true;
+}
+
+extern "C" vision_t *vision_create(const vision_image_t *template_img, int threads) {
+	if (threads < 1) return nullptr;
+
+	try {
+		cv::Mat scratch;
+		cv::Mat img;
+		if (!to_bgr(template_img, scratch, img)) return nullptr;
+
+		auto out = std::make_unique<vision>();
+		// the template is cloned in process_template, so the caller's buffer isn't kept
+		out->vision = std::make_unique<Vision>(img, threads);
+		return out.release();
+	} catch (const std::exception&) {
+		return nullptr;
+	}
+}
+
+extern "C" vision_status_t vision_process(vision_t *vision, const vision_image_t *frame) {
+	if (vision == nullptr) return VISION_ERR_INVALID_ARGUMENT;
+
+	try {
+		cv::Mat img;
+		if (!to_bgr(frame, vision->converted, img)) return VISION_ERR_INVALID_ARGUMENT;
+
+		vision->result = vision->vision->process(img, vision->ctx);
+		vision->has_result = true;
+		return VISION_OK;
+	} catch (const std::exception&) {
+		vision->has_result = false;
+		return VISION_ERR_INTERNAL;
+	}
+}
+
+extern "C" vision_status_t vision_get_result(const vision_t *vision, vision_result_t *out) {
+	if (vision == nullptr || out == nullptr) return VISION_ERR_INVALID_ARGUMENT;
+	if (!vision->has_result) return VISION_ERR_NO_RESULT;
+
+	*out = vision_result_t {};
+	if (vision->result.has_value()) {
+		const auto& target = *vision->result;
+		out->found = 1;
+		out->distance = target.distance;
+		out->angle = target.angle;
+		out->match = target.match;
+		out->bbox_x = target.rect.x;
+		out->bbox_y = target.rect.y;
+		out->bbox_width = target.rect.width;
+		out->bbox_height = target.rect.height;
+	}
+	return VISION_OK;
+}
+
+extern "C" void vision_destroy(vision_t *vision) {
+	delete vision;
+}
@@ -0,0 +1,70 @@
+#ifndef VISION_C_H
+#define VISION_C_H
+
+// C interface to the vision library, for running detection inside another process
+// all image buffers are owned by the caller, and are only read during the call they are passed to
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct vision vision_t;
+
+typedef enum {
+	VISION_FORMAT_BGR24,
+	VISION_FORMAT_RGB24,
+	VISION_FORMAT_BGRA32,
+	VISION_FORMAT_RGBA32,
+	// packed 4:2:2 yuv, as produced by most usb cameras
+	VISION_FORMAT_YUYV,
+} vision_format_t;
+
+typedef enum {
+	VISION_OK = 0,
+	VISION_ERR_INVALID_ARGUMENT = -1,
+	VISION_ERR_NO_RESULT = -2,
+	VISION_ERR_INTERNAL = -3,
+} vision_status_t;
+
+typedef struct {
+	const uint8_t *data;
+	int width;
+	int height;
+	// bytes between the start of consecutive rows
+	size_t stride;
+	vision_format_t format;
+} vision_image_t;
+
+typedef struct {
+	// 1 if a target was found, the other fields are only valid if it is set
+	int found;
+	double distance;
+	double angle;
+	// lower is a better match
+	double match;
+	int bbox_x;
+	int bbox_y;
+	int bbox_width;
+	int bbox_height;
+} vision_result_t;
+
+// returns NULL if the template is invalid or no target shape can be found in it
+vision_t *vision_create(const vision_image_t *template_img, int threads);
+
+// processes a single frame, the result can be read with vision_get_result
+// a handle must not be used by multiple threads at once, create one handle per thread instead
+vision_status_t vision_process(vision_t *vision, const vision_image_t *frame);
+
+// gets the result of the last call to vision_process
+vision_status_t vision_get_result(const vision_t *vision, vision_result_t *out);
+
+void vision_destroy(vision_t *vision);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif